@@ -0,0 +1,17 @@
+#!/bin/sh
+
+target=release
+if [ "$1" = "debug" ]; then
+    target=debug
+elif [ "$1" = "clean" ]; then
+    echo "Cleaning object files"
+    rm -rf bin/obj
+    echo "Done!"
+    exit 0
+fi
+
+echo "Starting $target mode build..."
+premake5 gmake2 --verbose
+make -C bin config=${target}_linux64 -j"$(nproc)"
+
+echo "Done!"
@@ -41,6 +41,25 @@ filter "platforms:Win64"
     }
     linkoptions { "/ignore:4099" }
 
+filter "system:linux"
+    platforms { "Linux64" }
+
+filter "platforms:Linux64"
+    defines { 
+        "OS_LINUX", 
+        "_GNU_SOURCE"
+    }
+    architecture "x64"
+    buildoptions { "-std=gnu11", "-pthread" }
+    linkoptions { "-pthread" }
+    disablewarnings {
+        "unused-parameter",
+        "missing-field-initializers",
+        "sign-compare",
+        "implicit-fallthrough",
+        "pointer-sign",
+    }
+
 filter "configurations:Debug"
     defines { "DEBUG_MODE", "DEBUG" }
     symbols "On"
@@ -1,80 +1,493 @@
 #include "allocator.h"
 #include "os.h"
 #include "log.h"
+#include "atomics.inl"
 #include <stdlib.h>
+#include <string.h>
 
 static void *system_alloc(Allocator *allocator, void *old_ptr, uint64_t old_size, uint64_t new_size, 
-        const char *file, uint32_t line)
+        uint32_t align, const char *file, uint32_t line)
 {
+    if (old_ptr)
+    {
+        record_deallocation(allocator, old_ptr, old_size);
+    }
+
     void *new_ptr = 0;
-    if (new_size != 0)
+    if (align <= ALLOCATOR_DEFAULT_ALIGN)
     {
-        new_ptr = realloc(old_ptr, new_size);
+        if (new_size != 0)
+        {
+            new_ptr = realloc(old_ptr, new_size);
+        }
+        else
+        {
+            free(old_ptr);
+        }
     }
     else
     {
-        free(old_ptr);
+#if defined(_MSC_VER)
+        if (new_size != 0)
+        {
+            new_ptr = _aligned_realloc(old_ptr, new_size, align);
+        }
+        else
+        {
+            _aligned_free(old_ptr);
+        }
+#else
+        // There is no aligned realloc, always move. Like `realloc()`, a failed allocation keeps the old block.
+        if (new_size != 0)
+        {
+            if (posix_memalign(&new_ptr, align, new_size) != 0)
+            {
+                new_ptr = 0;
+            }
+            else if (old_ptr)
+            {
+                memcpy(new_ptr, old_ptr, c_min(old_size, new_size));
+                free(old_ptr);
+            }
+        }
+        else
+        {
+            free(old_ptr);
+        }
+#endif
     }
 
-    record_allocation(old_ptr, old_size, new_ptr, new_size, file, line);
+    if (new_ptr)
+    {
+        record_allocation(allocator, new_ptr, new_size, file, line);
+    }
+    else if (old_ptr && new_size)
+    {
+        // A failed allocation left the old block as it was
+        record_allocation(allocator, old_ptr, old_size, file, line);
+    }
 
     return new_ptr;
 }
 
+enum {
+    // Stored in the low bits of a fixed virtual memory allocator's page aligned reserve size
+    FIXED_VM_LARGE_PAGES = 1,
+};
+
+// Lives in the page after the reserved range
+typedef struct Fixed_VM_State {
+    // Start of the reservation, the data is moved up to a large page boundary in large page mode
+    void *base;
+    uint64_t committed;
+} Fixed_VM_State;
+
 static void *fixed_vm_alloc(Allocator *allocator, void *old_ptr, uint64_t old_size, uint64_t new_size, 
-        const char *file, uint32_t line)
+        uint32_t align, const char *file, uint32_t line)
 {
+    fatal_checkf(align <= PAGE_SIZE, "Fixed virtual memory allocations are only page aligned!");
+
     old_size = ALIGN_SIZE(old_size, PAGE_SIZE);
     new_size = ALIGN_SIZE(new_size, PAGE_SIZE);
 
-    if (new_size > 0 && new_size <= old_size)
+    const uint64_t flags = (uint64_t)allocator->user_data & (PAGE_SIZE - 1);
+    const uint64_t reserve_size = (uint64_t)allocator->user_data & ~(uint64_t)(PAGE_SIZE - 1);
+    const uint64_t granularity = (flags & FIXED_VM_LARGE_PAGES) ? os_large_page_size() : PAGE_SIZE;
+    fatal_checkf(new_size <= reserve_size, "Fixed virtual memory allocator out of memory!");
+
+    if (old_ptr)
     {
-        return old_ptr;
+        record_deallocation(allocator, old_ptr, old_size);
     }
 
-    uint64_t reserve_size = (uint64_t)allocator->user_data;
-    fatal_checkf(new_size <= reserve_size, "Fixed virtual memory allocator out of memory!");
-
-    void *new_ptr = 0;
-    if (old_ptr == 0 && new_size > 0) 
+    uint8_t *new_ptr = old_ptr;
+    if (!old_ptr && new_size > 0)
     {
-        new_ptr = os_reserve(reserve_size);
-        os_commit(new_ptr, new_size);
-    } 
-    else if (new_size > 0) 
+        const uint64_t slack = granularity > PAGE_SIZE ? granularity : 0;
+        uint8_t *base = os_reserve(reserve_size + PAGE_SIZE + slack);
+        new_ptr = slack ? (uint8_t *)ALIGN_SIZE((uint64_t)base, granularity) : base;
+        if (flags & FIXED_VM_LARGE_PAGES)
+        {
+            os_advise_large_pages(new_ptr, reserve_size);
+        }
+
+        Fixed_VM_State *state = (Fixed_VM_State *)(new_ptr + reserve_size);
+        os_commit(state, sizeof(*state));
+        state->base = base;
+        state->committed = 0;
+    }
+
+    if (new_size > 0)
     {
-        new_ptr = old_ptr;
-        os_commit((char *)new_ptr + old_size, new_size - old_size);
-    } 
-    else if (new_size == 0) 
+        // Commit whole large pages so they can be backed by one, but only decommit once the size
+        // has dropped to half of what is committed to not thrash on repeated grow and shrink
+        Fixed_VM_State *state = (Fixed_VM_State *)(new_ptr + reserve_size);
+        const uint64_t target = c_min(ALIGN_SIZE(new_size, granularity), reserve_size);
+        if (target > state->committed)
+        {
+            os_commit(new_ptr + state->committed, target - state->committed);
+            state->committed = target;
+        }
+        else if (target <= state->committed / 2)
+        {
+            os_decommit(new_ptr + target, state->committed - target);
+            state->committed = target;
+        }
+    }
+    else if (old_ptr)
     {
+        Fixed_VM_State *state = (Fixed_VM_State *)((uint8_t *)old_ptr + reserve_size);
         new_ptr = 0;
-        os_release(old_ptr);
+        os_release(state->base);
     }
 
-    record_allocation(old_ptr, old_size, new_ptr, new_size, file, line);
+    if (new_ptr)
+    {
+        record_allocation(allocator, new_ptr, new_size, file, line);
+    }
 
     return new_ptr;
 }
 
-static int64_t bytes_allocated = 0;
+enum {
+    MAX_ALLOCATION_SITES = 4096,
+    // Capacity of the pointer table, pointers that don't fit are not attributed
+    MAX_TRACKED_POINTERS = 1 << 22,
+    // Pointers are only looked for this many entries from their home slot, so lookups of pointers
+    // that were never tracked stay short however many tombstones the table collects
+    MAX_POINTER_PROBES = 64,
+};
+
+// Marks a pointer entry whose pointer was untracked, it can be reused by the next insert
+#define POINTER_TOMBSTONE (~0ULL)
+
+typedef struct Site_Entry {
+    // 0 while the entry is unused
+    AtomicU64 key;
+    // Set once `file` and `line` are written
+    AtomicU32 ready;
+    uint32_t line;
+    const char *file;
+    AtomicU64 live_bytes;
+    AtomicU64 live_count;
+    AtomicU64 peak_bytes;
+    AtomicU64 churn_bytes;
+} Site_Entry;
+
+typedef struct Pointer_Entry {
+    // 0 if never used, otherwise the pointer or `POINTER_TOMBSTONE`
+    AtomicU64 ptr;
+    uint32_t site;
+    uint32_t padding;
+} Pointer_Entry;
+
+static AtomicU64 bytes_allocated = 0;
+
+static Site_Entry site_table[MAX_ALLOCATION_SITES];
+// Maps live pointers to their site index without locking. Reserved once tracking is first enabled.
+static Pointer_Entry *pointer_table;
+static AtomicU64 num_tracked_pointers;
+static AtomicU32 tracking_enabled;
+// 0 = uninitialized, 1 = initializing, 2 = initialized
+static AtomicU32 tracking_state;
+
+static inline uint64_t private__mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static inline void private__update_peak(volatile AtomicU64 *peak, int64_t value)
+{
+    uint64_t current = atomic_load_64(peak);
+    while ((int64_t)current < value)
+    {
+        const uint64_t prev = atomic_compare_exchange_64(peak, current, (uint64_t)value);
+        if (prev == current)
+            break;
+        current = prev;
+    }
+}
+
+// Finds or inserts the entry for `file`:`line` without locking
+static uint32_t private__site_index(const char *file, uint32_t line)
+{
+    const uint64_t key = private__mix((uint64_t)(uintptr_t)file ^ ((uint64_t)line << 48)) | 1;
+    uint32_t i = (uint32_t)(key % MAX_ALLOCATION_SITES);
+    for (uint32_t probe = 0; probe < MAX_ALLOCATION_SITES; ++probe)
+    {
+        Site_Entry *e = site_table + i;
+        uint64_t k = atomic_load_64(&e->key);
+        if (k == 0)
+        {
+            k = atomic_compare_exchange_64(&e->key, 0, key);
+            if (k == 0)
+            {
+                e->file = file;
+                e->line = line;
+                atomic_store_32(&e->ready, 1);
+                return i;
+            }
+        }
+        if (k == key)
+        {
+            while (!atomic_load_32(&e->ready))
+            {
+                os_yield_processor();
+            }
+            if (e->file == file && e->line == line)
+                return i;
+        }
+        i = (i + 1) % MAX_ALLOCATION_SITES;
+    }
+    return UINT32_MAX;
+}
+
+// A pointer is only ever tracked by the thread that allocated it and untracked by the one freeing
+// it, after it was handed over, so the entry of a pointer never races with itself. Entries are
+// claimed with a compare and swap, untracking leaves a tombstone that never turns back into 0, so
+// probes for a pointer can't stop short of its entry.
+static void private__track(void *p, uint64_t size, const char *file, uint32_t line)
+{
+    const uint32_t site = private__site_index(file, line);
+    if (site == UINT32_MAX)
+        return;
+
+    const uint64_t home = private__mix((uint64_t)(uintptr_t)p);
+    for (uint32_t probe = 0; probe < MAX_POINTER_PROBES; ++probe)
+    {
+        Pointer_Entry *entry = pointer_table + (home + probe) % MAX_TRACKED_POINTERS;
+        const uint64_t prev = atomic_load_64(&entry->ptr);
+        if (prev != 0 && prev != POINTER_TOMBSTONE)
+            continue;
+        if (atomic_compare_exchange_64(&entry->ptr, prev, (uint64_t)(uintptr_t)p) != prev)
+            continue;
+
+        entry->site = site;
+        atomic_fetch_add_64(&num_tracked_pointers, 1);
+
+        Site_Entry *e = site_table + site;
+        const int64_t live = (int64_t)(atomic_fetch_add_64(&e->live_bytes, size) + size);
+        atomic_fetch_add_64(&e->live_count, 1);
+        atomic_fetch_add_64(&e->churn_bytes, size);
+        private__update_peak(&e->peak_bytes, live);
+        return;
+    }
+}
 
-void record_allocation(void *old_ptr, uint64_t old_size, 
-    void *new_ptr, uint64_t new_size, const char *file, uint32_t line)
+static void private__untrack(void *p, uint64_t size)
 {
-    bytes_allocated += (new_size - old_size);
+    const uint64_t home = private__mix((uint64_t)(uintptr_t)p);
+    for (uint32_t probe = 0; probe < MAX_POINTER_PROBES; ++probe)
+    {
+        Pointer_Entry *entry = pointer_table + (home + probe) % MAX_TRACKED_POINTERS;
+        const uint64_t ptr = atomic_load_64(&entry->ptr);
+        if (ptr == 0)
+            return;
+        if (ptr != (uint64_t)(uintptr_t)p)
+            continue;
+
+        Site_Entry *e = site_table + entry->site;
+        atomic_store_64(&entry->ptr, POINTER_TOMBSTONE);
+        atomic_fetch_sub_64(&num_tracked_pointers, 1);
+        atomic_fetch_sub_64(&e->live_bytes, size);
+        atomic_fetch_sub_64(&e->live_count, 1);
+        return;
+    }
+}
+
+void record_allocation(Allocator *a, void *p, uint64_t size, const char *file, uint32_t line)
+{
+    atomic_fetch_add_64(&bytes_allocated, size);
+
+    if (a)
+    {
+        const int64_t bytes = (int64_t)(atomic_fetch_add_64(&a->totals.bytes, size) + size);
+        private__update_peak(&a->totals.peak_bytes, bytes);
+        atomic_fetch_add_64(&a->totals.num_allocations, 1);
+    }
+
+    if (atomic_load_32(&tracking_enabled))
+    {
+        private__track(p, size, file, line);
+    }
+}
+
+void record_deallocation(Allocator *a, void *p, uint64_t size)
+{
+    // Untracked first, the address is free to be handed out again once the caller releases it
+    if (atomic_load_64(&num_tracked_pointers))
+    {
+        private__untrack(p, size);
+    }
+
+    atomic_fetch_sub_64(&bytes_allocated, size);
+
+    if (a)
+    {
+        atomic_fetch_sub_64(&a->totals.bytes, size);
+        atomic_fetch_sub_64(&a->totals.num_allocations, 1);
+    }
 }
 
 int64_t total_bytes_allocated()
 {
-    return bytes_allocated;
+    return (int64_t)atomic_load_64(&bytes_allocated);
+}
+
+int64_t allocator_bytes_allocated(const Allocator *a)
+{
+    return (int64_t)atomic_load_64(&a->totals.bytes);
+}
+
+int64_t allocator_peak_bytes_allocated(const Allocator *a)
+{
+    return (int64_t)atomic_load_64(&a->totals.peak_bytes);
+}
+
+int64_t allocator_num_allocations(const Allocator *a)
+{
+    return (int64_t)atomic_load_64(&a->totals.num_allocations);
+}
+
+void allocation_tracking_enable(bool enabled)
+{
+    if (enabled && atomic_load_32(&tracking_state) != 2)
+    {
+        if (atomic_compare_exchange_32(&tracking_state, 0, 1) == 0)
+        {
+            // Only the touched pages of the table are backed by memory
+            const uint64_t table_size = MAX_TRACKED_POINTERS * sizeof(Pointer_Entry);
+            pointer_table = os_reserve(table_size);
+            fatal_checkf(pointer_table, "Failed to reserve the allocation tracking table!");
+            os_commit(pointer_table, table_size);
+            atomic_store_32(&tracking_state, 2);
+        }
+        while (atomic_load_32(&tracking_state) != 2)
+        {
+            os_yield_processor();
+        }
+    }
+    atomic_store_32(&tracking_enabled, enabled);
+}
+
+static int private__compare_live_bytes(const void *a, const void *b)
+{
+    const Allocation_Site *sa = a, *sb = b;
+    const int64_t da = sa->live_bytes < 0 ? -sa->live_bytes : sa->live_bytes;
+    const int64_t db = sb->live_bytes < 0 ? -sb->live_bytes : sb->live_bytes;
+    return da < db ? 1 : da > db ? -1 : 0;
+}
+
+Allocation_Snapshot allocation_snapshot(Allocator *a)
+{
+    uint32_t capacity = 0;
+    for (uint32_t i = 0; i < MAX_ALLOCATION_SITES; ++i)
+    {
+        capacity += atomic_load_32(&site_table[i].ready);
+    }
+
+    // One more in case the allocation of the copy is made from a new site
+    capacity += 1;
+
+    Allocation_Snapshot s = { 0 };
+    s.sites = c_alloc(a, capacity * sizeof(*s.sites));
+    for (uint32_t i = 0; i < MAX_ALLOCATION_SITES && s.num_sites < capacity; ++i)
+    {
+        Site_Entry *e = site_table + i;
+        if (!atomic_load_32(&e->ready))
+            continue;
+        s.sites[s.num_sites++] = (Allocation_Site) {
+            .file = e->file,
+            .line = e->line,
+            .live_bytes = (int64_t)atomic_load_64(&e->live_bytes),
+            .live_count = (int64_t)atomic_load_64(&e->live_count),
+            .peak_bytes = (int64_t)atomic_load_64(&e->peak_bytes),
+            .churn_bytes = atomic_load_64(&e->churn_bytes),
+        };
+    }
+    if (s.num_sites < capacity)
+    {
+        s.sites = s.num_sites ? c_realloc(a, s.sites, capacity * sizeof(*s.sites), s.num_sites * sizeof(*s.sites))
+                              : c_free(a, s.sites, capacity * sizeof(*s.sites));
+    }
+    if (s.num_sites)
+        qsort(s.sites, s.num_sites, sizeof(*s.sites), private__compare_live_bytes);
+    return s;
+}
+
+Allocation_Snapshot allocation_snapshot_diff(const Allocation_Snapshot *before, const Allocation_Snapshot *after, Allocator *a)
+{
+    Allocation_Snapshot s = { 0 };
+    if (!after->num_sites)
+        return s;
+
+    s.sites = c_alloc(a, after->num_sites * sizeof(*s.sites));
+    for (uint32_t i = 0; i < after->num_sites; ++i)
+    {
+        Allocation_Site site = after->sites[i];
+        // Sites are never removed, so every site in `before` is also in `after`
+        for (uint32_t j = 0; j < before->num_sites; ++j)
+        {
+            const Allocation_Site *b = before->sites + j;
+            if (b->file == site.file && b->line == site.line)
+            {
+                site.live_bytes -= b->live_bytes;
+                site.live_count -= b->live_count;
+                site.churn_bytes -= b->churn_bytes;
+                break;
+            }
+        }
+        if (site.live_bytes || site.live_count || site.churn_bytes)
+            s.sites[s.num_sites++] = site;
+    }
+    if (s.num_sites < after->num_sites)
+    {
+        s.sites = s.num_sites ? c_realloc(a, s.sites, after->num_sites * sizeof(*s.sites), s.num_sites * sizeof(*s.sites))
+                              : c_free(a, s.sites, after->num_sites * sizeof(*s.sites));
+    }
+    if (s.num_sites)
+        qsort(s.sites, s.num_sites, sizeof(*s.sites), private__compare_live_bytes);
+    return s;
+}
+
+void allocation_snapshot_free(Allocation_Snapshot *s, Allocator *a)
+{
+    if (s->sites)
+        c_free(a, s->sites, s->num_sites * sizeof(*s->sites));
+    s->sites = 0;
+    s->num_sites = 0;
+}
+
+void allocation_snapshot_dump(const Allocation_Snapshot *s, uint32_t max_sites)
+{
+    const uint32_t n = c_min(s->num_sites, max_sites);
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        const Allocation_Site *site = s->sites + i;
+        log_info("%s(%u): %lld bytes live in %lld allocations, peak %lld bytes, churn %llu bytes",
+            site->file, site->line, (long long)site->live_bytes, (long long)site->live_count,
+            (long long)site->peak_bytes, (unsigned long long)site->churn_bytes);
+    }
 }
 
 Allocator allocator_create_fixed_vm(uint64_t reserve_size)
 {
     Allocator a = {
         .allocate_func = fixed_vm_alloc,
-        .user_data = (void *)reserve_size,
+        .user_data = (void *)ALIGN_SIZE(reserve_size, PAGE_SIZE),
+    };
+    return a;
+}
+
+Allocator allocator_create_fixed_vm_large_pages(uint64_t reserve_size)
+{
+    const uint64_t large_page_size = os_large_page_size();
+    Allocator a = {
+        .allocate_func = fixed_vm_alloc,
+        .user_data = (void *)(ALIGN_SIZE(reserve_size, large_page_size) | FIXED_VM_LARGE_PAGES),
     };
     return a;
 }
@@ -4,23 +4,86 @@
 #define PAGE_SIZE (4096)
 #define ALIGN_SIZE(size, align) (((size + align - 1) / align) * align)
 
+// Alignment of allocations made with an `align` of 0, matches `malloc()` on 64-bit platforms
+#define ALLOCATOR_DEFAULT_ALIGN (16)
+
+typedef struct Allocator_Totals {
+    // Updated atomically, signed values are stored as two's complement
+    uint64_t bytes;
+    uint64_t peak_bytes;
+    uint64_t num_allocations;
+} Allocator_Totals;
+
+// `align` is a power of two or 0 for `ALLOCATOR_DEFAULT_ALIGN`. Like the old size, it must be
+// the same in every call for a given pointer.
 typedef struct Allocator {
-    void *(*allocate_func)(struct Allocator *allocator, void *p, uint64_t old_size, uint64_t new_size, const char *file, uint32_t line);
+    void *(*allocate_func)(struct Allocator *allocator, void *p, uint64_t old_size, uint64_t new_size, uint32_t align, const char *file, uint32_t line);
     void *user_data;
+    // Updated by `record_allocation()` and `record_deallocation()`
+    Allocator_Totals totals;
 } Allocator;
 
-void record_allocation(void *old_ptr, uint64_t old_size, void *new_ptr, uint64_t new_size,
-    const char *file, uint32_t line);
+// Called by allocators once `p` is allocated. A reallocation records the old block with
+// `record_deallocation()` and the new one with this, even when it was resized in place. Thread-safe.
+void record_allocation(Allocator *a, void *p, uint64_t size, const char *file, uint32_t line);
+
+// Called by allocators before `p` is freed or reallocated, another thread can be handed the same
+// address as soon as it is released. If the reallocation then fails, record the old block again.
+void record_deallocation(Allocator *a, void *p, uint64_t size);
 
 int64_t total_bytes_allocated();
 
-#define c_alloc(a, size)                      (a)->allocate_func(a, 0, 0, size, __FILE__, __LINE__)
-#define c_alloc_at(a, size, file, line)       (a)->allocate_func(a, 0, 0, size, file, line)
-#define c_free(a, p, size)                    (a)->allocate_func(a, p, size, 0, __FILE__, __LINE__)
-#define c_realloc(a, p, old_size, new_size)   (a)->allocate_func(a, p, old_size, new_size, __FILE__, __LINE__) 
+int64_t allocator_bytes_allocated(const Allocator *a);
+int64_t allocator_peak_bytes_allocated(const Allocator *a);
+int64_t allocator_num_allocations(const Allocator *a);
+
+typedef struct Allocation_Site {
+    const char *file;
+    uint32_t line;
+    int64_t live_bytes;
+    int64_t live_count;
+    int64_t peak_bytes;
+    // Total bytes ever requested from the site, including reallocations
+    uint64_t churn_bytes;
+} Allocation_Site;
+
+typedef struct Allocation_Snapshot {
+    Allocation_Site *sites;
+    uint32_t num_sites;
+} Allocation_Snapshot;
+
+// Enables attribution of live allocations to the `file` and `line` they were made from.
+// Frees are charged to the site that made the allocation, a reallocation moves it to the
+// reallocating site. Allocations made while tracking is disabled are not attributed.
+void allocation_tracking_enable(bool enabled);
+
+// Copies the call site table, sorted by live bytes in descending order
+Allocation_Snapshot allocation_snapshot(Allocator *a);
 
-// Creates a fixed virtual memory allocator
+// Per site change from `before` to `after`. Peaks are taken from `after`, sites without changes are omitted.
+Allocation_Snapshot allocation_snapshot_diff(const Allocation_Snapshot *before, const Allocation_Snapshot *after, Allocator *a);
+
+void allocation_snapshot_free(Allocation_Snapshot *s, Allocator *a);
+
+// Logs the first `max_sites` sites of `s`
+void allocation_snapshot_dump(const Allocation_Snapshot *s, uint32_t max_sites);
+
+#define c_alloc(a, size)                      (a)->allocate_func(a, 0, 0, size, 0, __FILE__, __LINE__)
+#define c_alloc_at(a, size, file, line)       (a)->allocate_func(a, 0, 0, size, 0, file, line)
+#define c_free(a, p, size)                    (a)->allocate_func(a, p, size, 0, 0, __FILE__, __LINE__)
+#define c_realloc(a, p, old_size, new_size)   (a)->allocate_func(a, p, old_size, new_size, 0, __FILE__, __LINE__) 
+
+#define c_alloc_aligned(a, size, align)                     (a)->allocate_func(a, 0, 0, size, align, __FILE__, __LINE__)
+#define c_free_aligned(a, p, size, align)                   (a)->allocate_func(a, p, size, 0, align, __FILE__, __LINE__)
+#define c_realloc_aligned(a, p, old_size, new_size, align)  (a)->allocate_func(a, p, old_size, new_size, align, __FILE__, __LINE__)
+
+// Creates an allocator for a single allocation that can grow in place up to `reserve_size` bytes.
+// Pages are committed as it grows and decommitted once it shrinks to half of what is committed.
 Allocator allocator_create_fixed_vm(uint64_t reserve_size);
 
+// Like `allocator_create_fixed_vm()` but backed by large pages where the OS can commit them on
+// demand, which cuts down on TLB misses for big allocations. Commits whole large pages.
+Allocator allocator_create_fixed_vm_large_pages(uint64_t reserve_size);
+
 // System default allocator
 extern struct Allocator *system_allocator;
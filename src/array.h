@@ -1,6 +1,8 @@
 #pragma once
 #include "basic.h"
 #include "allocator.h"
+#include "os.h"
+#include "log.h"
 
 #include <string.h>
 
@@ -9,8 +11,31 @@ typedef struct Array_Header
 {
     uint64_t capacity;
     uint64_t size;
+    // Alignment of the data set by `array_init_aligned()`, 0 for the allocator's default
+    uint32_t align;
+    // `Array_Flags`
+    uint32_t flags;
+    // Maximum capacity of an array created by `array_init_vm()`, 0 for arrays using an allocator
+    uint64_t reserved_capacity;
 } Array_Header;
 
+enum {
+    // Pages of virtual memory arrays are committed in chunks of this size
+    ARRAY_VM_COMMIT_SIZE = KB(64),
+};
+
+typedef enum Array_Flags {
+    // Items are stored in caller provided `ARRAY_INLINE()` storage
+    ARRAY_FLAG_INLINE = 0x1,
+    // Inline array that can't spill to the allocator
+    ARRAY_FLAG_FIXED = 0x2,
+} Array_Flags;
+
+// Storage for an array that keeps up to `n` items inline, e.g. in the struct owning the array.
+// Items must not be aligned to more than 32 bytes, so they directly follow the header.
+#define ARRAY_INLINE(T, n) \
+    struct { Array_Header header; T items[n]; }
+
 // Pointer to array header
 #define array_header(a) \
     ((Array_Header *)((uint8_t *)(a) - sizeof(Array_Header)))
@@ -25,11 +50,47 @@ typedef struct Array_Header
 
 // Free memory and null array pointer
 #define array_free_at(a, allocator, file, line) \
-    ((*(void **)&(a)) = array__set_capacity_internal((void *)a, 0, sizeof(*(a)), allocator, file, line))
+    ((*(void **)&(a)) = array__set_capacity_internal((void *)a, 0, sizeof(*(a)), 0, allocator, file, line))
 
 #define array_free(a, allocator) \
     array_free_at(a, allocator, __FILE__, __LINE__)
 
+// Allocate a null array with room for `n` items whose data is aligned to `align`, the alignment
+// is kept when the array grows
+#define array_init_aligned_at(a, n, align, allocator, file, line) \
+    ((*(void **)&(a)) = array__set_capacity_internal((void *)a, (n), sizeof(*(a)), (align), allocator, file, line))
+
+#define array_init_aligned(a, n, align, allocator) \
+    array_init_aligned_at(a, n, align, allocator, __FILE__, __LINE__)
+
+// Make a null array reserve virtual memory for `max_count` items and commit it as the array grows.
+// Items never move, so pointers to them stay valid, and growing never copies. Such arrays ignore
+// the allocator passed to the other macros, `array_free()` releases the reservation.
+#define array_init_vm(a, max_count) \
+    ((*(void **)&(a)) = array__init_vm_internal((void *)a, (max_count), sizeof(*(a))))
+
+// Make a null array use `storage` declared with `ARRAY_INLINE()` for its first items. Pushing past
+// them moves the items to the allocator passed to the other macros, like a normal array. This saves
+// the allocation, and the pointer chase to it, for arrays that usually hold a few items. Freeing
+// leaves `storage` alone, only spilled items are freed. The array points into `storage`, so if
+// `storage` is copied elsewhere, call `array_inline_moved()` on the copy.
+#define array_init_inline(a, storage) \
+    ((*(void **)&(a)) = array__init_inline_internal((void *)a, &(storage)->header, ARRAY_COUNT((storage)->items), 0))
+
+// `array_init_inline()` for an array that never holds more than fits in `storage`, growing past it
+// is a fatal error
+#define array_init_fixed(a, storage) \
+    ((*(void **)&(a)) = array__init_inline_internal((void *)a, &(storage)->header, ARRAY_COUNT((storage)->items), ARRAY_FLAG_FIXED))
+
+// Whether the items are stored inline
+#define array_is_inline(a) \
+    ((a) ? (array_header(a)->flags & ARRAY_FLAG_INLINE) != 0 : false)
+
+// Point `a` at `storage` after the storage holding its inline items was copied there, arrays that
+// have spilled to the allocator are left as is
+#define array_inline_moved(a, storage) \
+    (array_is_inline(a) ? ((*(void **)&(a)) = (storage)->items) : 0)
+
 // Add item to end of array and grow geometrically if needed
 #define array_push_at(a, v, allocator, file, line) \
     (array_ensure_at(a, array_size(a) + 1, allocator, file, line), (a)[array_header(a)->size++] = (v))
@@ -95,30 +156,122 @@ typedef struct Array_Header
 #define array_insert(arr, v, n, pos, allocator) \
     array_insert_at(arr, v, n, pos, allocator, __FILE__, __LINE__)
 
+static inline uint64_t array__vm_reserve_size(uint64_t capacity, uint64_t item_size)
+{
+    return ALIGN_SIZE(sizeof(Array_Header) + item_size * capacity, PAGE_SIZE);
+}
+
+static inline void *array__init_vm_internal(void *arr, uint64_t max_count, uint64_t item_size)
+{
+    fatal_checkf(!arr && max_count, "Only empty arrays can be made virtual memory arrays");
+    const uint64_t reserve_size = array__vm_reserve_size(max_count, item_size);
+    uint8_t *p = os_reserve(reserve_size);
+    const uint64_t committed = c_min((uint64_t)ARRAY_VM_COMMIT_SIZE, reserve_size);
+    os_commit(p, committed);
+
+    void *new_a = p + sizeof(Array_Header);
+    array_header(new_a)->size = 0;
+    array_header(new_a)->capacity = c_min((committed - sizeof(Array_Header)) / item_size, max_count);
+    array_header(new_a)->align = 0;
+    array_header(new_a)->flags = 0;
+    array_header(new_a)->reserved_capacity = max_count;
+    return new_a;
+}
+
+static inline void *array__init_inline_internal(void *arr, Array_Header *header, uint64_t n, uint32_t flags)
+{
+    fatal_checkf(!arr, "Only empty arrays can be made inline arrays");
+    header->capacity = n;
+    header->size = 0;
+    header->align = 0;
+    header->flags = ARRAY_FLAG_INLINE | flags;
+    header->reserved_capacity = 0;
+    return header + 1;
+}
+
+// Moves the items of an inline array to the allocator once they don't fit, a capacity of 0 detaches
+// the array from its storage without freeing it
+static inline void *array__set_inline_capacity(void *arr, uint64_t new_capacity, uint64_t item_size,
+    struct Allocator *allocator, const char *file, uint32_t line);
+
+// Commits pages of a virtual memory array up to `new_capacity`, capacities below the current one
+// keep the memory committed
+static inline void *array__set_vm_capacity(void *arr, uint64_t new_capacity, uint64_t item_size)
+{
+    Array_Header *h = array_header(arr);
+    uint8_t *p = (uint8_t *)h;
+    if (!new_capacity)
+    {
+        os_release(p);
+        return 0;
+    }
+    if (new_capacity <= h->capacity)
+        return arr;
+
+    fatal_checkf(new_capacity <= h->reserved_capacity, "Virtual memory array exhausted!");
+    const uint64_t reserve_size = array__vm_reserve_size(h->reserved_capacity, item_size);
+    const uint64_t committed_end = sizeof(Array_Header) + item_size * h->capacity;
+    const uint64_t commit_start = committed_end / PAGE_SIZE * PAGE_SIZE;
+    const uint64_t commit_end = c_min(ALIGN_SIZE(sizeof(Array_Header) + item_size * new_capacity, (uint64_t)ARRAY_VM_COMMIT_SIZE), reserve_size);
+    os_commit(p + commit_start, commit_end - commit_start);
+    h->capacity = c_min((commit_end - sizeof(Array_Header)) / item_size, h->reserved_capacity);
+    return arr;
+}
+
+// `align` only applies to arrays that aren't allocated yet, others keep their alignment
 static inline void *array__set_capacity_internal(void *arr, uint64_t new_capacity, uint64_t item_size,
-    struct Allocator *allocator, const char *file, uint32_t line)
+    uint32_t align, struct Allocator *allocator, const char *file, uint32_t line)
 {
-    uint8_t *p = arr ? (uint8_t *)array_header(arr) : 0;
-    const uint64_t extra = sizeof(Array_Header);
+    if (arr && array_header(arr)->reserved_capacity)
+        return array__set_vm_capacity(arr, new_capacity, item_size);
+    if (arr && (array_header(arr)->flags & ARRAY_FLAG_INLINE))
+        return array__set_inline_capacity(arr, new_capacity, item_size, allocator, file, line);
+
+    align = arr ? array_header(arr)->align : align;
+    // Over-aligned arrays put the header at the end of an `align` sized prefix
+    const uint64_t extra = align > sizeof(Array_Header) ? align : sizeof(Array_Header);
+    uint8_t *p = arr ? (uint8_t *)arr - extra : 0;
     const uint64_t size = array_size(arr);
     const uint64_t bytes_before = arr ? item_size * array_capacity(arr) + extra : 0;
     const uint64_t bytes_after = new_capacity ? item_size * new_capacity + extra : 0;
-    p = (uint8_t *)allocator->allocate_func(allocator, p, bytes_before, bytes_after, file, line);
+    p = (uint8_t *)allocator->allocate_func(allocator, p, bytes_before, bytes_after, align, file, line);
     void *new_a = p ? p + extra : p;
     if (new_a) {
         array_header(new_a)->size = size;
         array_header(new_a)->capacity = new_capacity;
+        array_header(new_a)->align = align;
+        array_header(new_a)->flags = 0;
+        array_header(new_a)->reserved_capacity = 0;
     }
     return new_a;
 }
 
+static inline void *array__set_inline_capacity(void *arr, uint64_t new_capacity, uint64_t item_size,
+    struct Allocator *allocator, const char *file, uint32_t line)
+{
+    Array_Header *h = array_header(arr);
+    if (!new_capacity)
+        return 0;
+    if (new_capacity <= h->capacity)
+        return arr;
+
+    fatal_checkf(!(h->flags & ARRAY_FLAG_FIXED), "Fixed capacity array exhausted!");
+    void *new_a = array__set_capacity_internal(0, new_capacity, item_size, 0, allocator, file, line);
+    memcpy(new_a, arr, h->size * item_size);
+    array_header(new_a)->size = h->size;
+    return new_a;
+}
+
 static inline void *array__grow_internal(void *arr, uint64_t to_at_least, uint64_t item_size,
     struct Allocator *allocator, const char *file, uint32_t line)
 {
     const uint64_t capacity = arr ? array_capacity(arr) : 0;
     if (capacity >= to_at_least)
         return arr;
+    // Virtual memory arrays commit what they need, they don't have to copy
+    if (arr && array_header(arr)->reserved_capacity)
+        return array__set_vm_capacity(arr, to_at_least, item_size);
     const uint64_t min_capacity = capacity ? capacity * 2 : 16;
     const uint64_t new_capacity = min_capacity > to_at_least ? min_capacity : to_at_least;
-    return array__set_capacity_internal(arr, new_capacity, item_size, allocator, file, line);
+    return array__set_capacity_internal(arr, new_capacity, item_size, 0, allocator, file, line);
 }
\ No newline at end of file
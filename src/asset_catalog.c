@@ -1,26 +1,31 @@
 #include "asset_catalog.h"
-#include "hash.h"
+#include "hash_map.h"
 #include "allocator.h"
 #include "murmur_hash64.h"
 #include "array.h"
+#include "paged_array.h"
+#include "slot_map.h"
+#include "object_pool.h"
 #include "os.h"
 #include "log.h"
 
+HASH_MAP_DECLARE(Asset_Name_Map, asset_name_map, uint64_t, Asset_Id, hash_map_hash_u64, hash_map_equal_u64)
+
 struct Asset_Catalog {
-    void *data;
+    // Assets stay at the same address for the lifetime of the catalog
+    Paged_Array data;
     uint64_t asset_size;
     uint64_t descriptor_size;
-    uint64_t size;
-    uint64_t capacity;
-    uint32_t *free_slots;
-    uint32_t *generation;
+    // Holds the name hash of each asset, 0 if unnamed. Other per asset data is indexed by `Asset_Id.index`.
+    Slot_Map handles;
     uint64_t *tags;
-    uint64_t *names;
-    Hash name_to_index;
+    // Only holds live assets, names are removed when their asset is freed
+    Asset_Name_Map name_to_id;
     Asset_Catalog_Callbacks callbacks;
-    Allocator data_allocator;
     Allocator hash_allocator;
     Allocator generic_allocator;
+    // Descriptors are allocated on the calling thread and freed after the loader thread is done with them
+    Allocator *descriptor_pool;
     bool no_descriptor;
     Asset_Id placeholder_asset;
     Asset_Id fallback_asset;
@@ -55,8 +60,9 @@ struct Asset_Loader {
     .initialized = false,
 };
 
-static void asset_loader_thread_entry_point(struct Asset_Loader *ctx)
+static void asset_loader_thread_entry_point(void *user_data)
 {
+    struct Asset_Loader *ctx = (struct Asset_Loader *)user_data;
     while (true)
     {
         os_semaphore_wait(ctx->pending_assets_counter);
@@ -88,65 +94,36 @@ static void asset_loader_thread_entry_point(struct Asset_Loader *ctx)
 
 static inline bool private__is_asset_valid(Asset_Catalog *catalog, Asset_Id asset_id)
 {
-    return asset_id.id != INVALID_ASSET_ID && asset_id.generation == catalog->generation[asset_id.index];
+    return asset_id.id != INVALID_ASSET_ID && slot_map_has(&catalog->handles, (Slot_Id) { .id = asset_id.id });
 }
 
 static Asset_Id private__name_to_asset_id(Asset_Catalog *catalog, uint64_t name_hash)
 {
-    const uint64_t index = hash_get_default(&catalog->name_to_index, name_hash, INVALID_ASSET_ID);
-    if (index != INVALID_ASSET_ID && catalog->names[index] == name_hash)
-    {
-        Asset_Id asset_id = {
-            .index = (uint32_t)index,
-            .generation = catalog->generation[index],
-        };
-        return asset_id;
-    }
-    return (Asset_Id) { .id = INVALID_ASSET_ID };
+    const Asset_Id *asset_id = asset_name_map_get(&catalog->name_to_id, name_hash);
+    return asset_id ? *asset_id : (Asset_Id) { .id = INVALID_ASSET_ID };
 }
 
-static void private__ensure_buffer_capacity(Asset_Catalog *catalog, uint64_t items_to_add)
+static inline uint64_t private__asset_name(Asset_Catalog *catalog, Asset_Id asset_id)
 {
-    uint64_t to_at_least = catalog->size + items_to_add;
-    if (to_at_least > catalog->capacity) 
-    {
-        Allocator *a = &catalog->data_allocator;
-        const uint64_t min_capacity = catalog->capacity ? catalog->capacity * 2 : 16;
-        const uint64_t new_capacity = min_capacity > to_at_least ? min_capacity : to_at_least;
-        const uint64_t bytes_before = catalog->data ? catalog->asset_size * catalog->capacity : 0;
-        const uint64_t bytes_after = catalog->asset_size * new_capacity;
-        catalog->data = a->allocate_func(a, catalog->data, bytes_before, bytes_after, __FILE__, __LINE__);
-        catalog->capacity = new_capacity;
-    }
+    return *slot_map_get_typed(&catalog->handles, uint64_t, ((Slot_Id) { .id = asset_id.id }));
 }
 
 static Asset_Id private__make_asset(Asset_Catalog *catalog, uint64_t name_hash, uint64_t tag_hash)
 {
-    uint32_t index;
+    const Asset_Id asset_id = { .id = slot_map_insert(&catalog->handles, &catalog->generic_allocator).id };
+    const uint32_t index = asset_id.index;
 
-    if (array_size(catalog->free_slots) > 0)
-    {
-        index = array_pop(catalog->free_slots);
-    }
-    else
+    // Slots of freed assets are reused first, a new slot is always the next one
+    if (index == catalog->data.size)
     {
-        array_push(catalog->generation, 0, &catalog->generic_allocator);
         array_push(catalog->tags, 0, &catalog->generic_allocator);
-        array_push(catalog->names, 0, &catalog->generic_allocator);
-        private__ensure_buffer_capacity(catalog, 1);
-        index = (uint32_t)catalog->size;
-        ++catalog->size;
+        paged_array_push(&catalog->data);
     }
 
-    const Asset_Id asset_id = {
-        .index = index,
-        .generation = catalog->generation[index],
-    };
-
     if (name_hash)
     {
-        catalog->names[index] = name_hash;
-        hash_add(&catalog->name_to_index, name_hash, index, &catalog->hash_allocator);
+        *slot_map_get_typed(&catalog->handles, uint64_t, ((Slot_Id) { .id = asset_id.id })) = name_hash;
+        asset_name_map_add(&catalog->name_to_id, name_hash, asset_id, &catalog->hash_allocator);
     }
 
     if (tag_hash)
@@ -157,19 +134,21 @@ static Asset_Id private__make_asset(Asset_Catalog *catalog, uint64_t name_hash,
     return asset_id;
 }
 
-static void private__free_asset(Asset_Catalog *catalog, uint32_t index)
+static void private__free_asset(Asset_Catalog *catalog, Asset_Id asset_id)
 {
-    void *asset = (uint8_t *)catalog->data + catalog->asset_size * index;
+    const uint32_t index = asset_id.index;
+    const uint64_t name_hash = private__asset_name(catalog, asset_id);
+    void *asset = paged_array_get(&catalog->data, index);
 
     if (catalog->placeholder_asset.index == index)
     {
-        log_error("Cannot free placeholder asset (%zu)!", catalog->names[index]);
+        log_error("Cannot free placeholder asset (%zu)!", name_hash);
         return;
     }
 
     if (catalog->fallback_asset.index == index)
     {
-        log_error("Cannot free fallback asset (%zu)!", catalog->names[index]);
+        log_error("Cannot free fallback asset (%zu)!", name_hash);
         return;
     }
 
@@ -183,11 +162,12 @@ static void private__free_asset(Asset_Catalog *catalog, uint32_t index)
         memset(asset, 0, catalog->asset_size);
     }
 
-    hash_remove(&catalog->name_to_index, catalog->names[index]);
-    catalog->generation[index] += 1;
+    if (name_hash)
+    {
+        asset_name_map_remove(&catalog->name_to_id, name_hash, 0);
+    }
+    slot_map_remove(&catalog->handles, (Slot_Id) { .id = asset_id.id });
     catalog->tags[index] = 0;
-    catalog->names[index] = 0;
-    array_push(catalog->free_slots, index, &catalog->generic_allocator);
 }
 
 Asset_Catalog *make_asset_catalog(uint64_t reserve_count, Asset_Catalog_Interface *i)
@@ -195,28 +175,24 @@ Asset_Catalog *make_asset_catalog(uint64_t reserve_count, Asset_Catalog_Interfac
     if (!asset_loader->initialized)
     {
         asset_loader->allocator = system_allocator;
-        asset_loader->thread_handle = os_create_thread(asset_loader_thread_entry_point, asset_loader, MB(4));
         asset_loader->pending_assets_counter = os_create_semaphore(0);
         asset_loader->loaded_assets_counter = os_create_semaphore(0);
         os_create_critical_section(&asset_loader->pending_assets_cs);
+        // Started last, the thread waits on the semaphores right away
+        asset_loader->thread_handle = os_create_thread(asset_loader_thread_entry_point, asset_loader, MB(4));
         asset_loader->initialized = true;
     }
 
     Asset_Catalog *c = c_alloc(system_allocator, sizeof(*c));
-    const uint64_t reserve_size = ALIGN_SIZE(i->asset_size * reserve_count, PAGE_SIZE);
-    c->data_allocator = allocator_create_fixed_vm(reserve_size);
+    paged_array_init(&c->data, c_max(i->asset_size, 1), 0, system_allocator);
     c->hash_allocator = *system_allocator;
     c->generic_allocator = *system_allocator;
     c->asset_size = i->asset_size;
     c->descriptor_size = i->no_descriptor ? i->asset_size : i->descriptor_size;
-    c->size = 0;
-    c->capacity = 0;
-    c->data = 0;
-    c->free_slots = 0;
-    c->generation = 0;
+    c->descriptor_pool = object_pool_create((uint32_t)c_max(c->descriptor_size, 1), c_max(reserve_count, 1), system_allocator);
+    c->handles = slot_map_init(sizeof(uint64_t));
     c->tags = 0;
-    c->names = 0;
-    c->name_to_index = (Hash) { 0 };
+    c->name_to_id = (Asset_Name_Map) { 0 };
     c->callbacks = i->callbacks;
     c->no_descriptor = i->no_descriptor;
     c->placeholder_asset = (Asset_Id) { .id = INVALID_ASSET_ID };
@@ -240,22 +216,18 @@ void free_asset_catalog(Asset_Catalog *catalog)
     Asset_Catalog_Callbacks *callbacks = &catalog->callbacks;
     if (callbacks->asset_free) 
     {
-        for (uint32_t i = 0; i < catalog->size; ++i) 
+        for (uint32_t i = 0; i < slot_map_size(&catalog->handles); ++i) 
         {
-            void *asset = (uint8_t *)catalog->data + catalog->asset_size * i;
-            if (asset)
-            {
-                callbacks->asset_free(asset);
-            }
+            const Slot_Id id = slot_map_id_at(&catalog->handles, i);
+            callbacks->asset_free(paged_array_get(&catalog->data, id.index));
         }
     }
 
-    array_free(catalog->free_slots, &catalog->generic_allocator);
-    array_free(catalog->generation, &catalog->generic_allocator);
+    slot_map_free(&catalog->handles, &catalog->generic_allocator);
     array_free(catalog->tags, &catalog->generic_allocator);
-    array_free(catalog->names, &catalog->generic_allocator);
-    hash_free(&catalog->name_to_index, &catalog->hash_allocator);
-    c_free(&catalog->data_allocator, catalog->data, catalog->asset_size * catalog->capacity);
+    asset_name_map_free(&catalog->name_to_id, &catalog->hash_allocator);
+    paged_array_free(&catalog->data);
+    object_pool_destroy(catalog->descriptor_pool);
     c_free(system_allocator, catalog, sizeof(*catalog));
 }
 
@@ -263,20 +235,20 @@ void free_asset(Asset_Catalog *catalog, Asset_Id asset_id)
 {
     if (private__is_asset_valid(catalog, asset_id))
     {
-        private__free_asset(catalog, asset_id.index);
+        private__free_asset(catalog, asset_id);
     }
 }
 
 void free_assets_by_tag(Asset_Catalog *catalog, const char *tag)
 {
     const uint64_t tag_hash = murmur_hash64a_string(tag);
-    for (uint32_t i = 0; i < (uint32_t)array_size(catalog->tags); ++i)
+    // Backwards since freeing moves the last live asset into the freed position
+    for (uint32_t i = slot_map_size(&catalog->handles); i-- > 0;)
     {
-        if (catalog->tags[i] == tag_hash)
+        const Slot_Id id = slot_map_id_at(&catalog->handles, i);
+        if (catalog->tags[id.index] == tag_hash)
         {
-            // The tag is reset to `0` when the asset is invalidated so we are safe to assume that
-            // all assets that have a tag still are valid
-            private__free_asset(catalog, i);
+            private__free_asset(catalog, (Asset_Id) { .id = id.id });
         }
     }
 }
@@ -322,7 +294,7 @@ Asset_Id find_or_load_asset(Asset_Catalog *catalog, const char *path, const char
         pending_asset.data = data;
         pending_asset.size = size;
         pending_asset.asset_state = ASSET_STATE_PENDING;
-        pending_asset.descriptor = c_alloc(asset_allocator, catalog->descriptor_size);
+        pending_asset.descriptor = c_alloc(catalog->descriptor_pool, catalog->descriptor_size);
 
         os_enter_critical_section(&asset_loader->pending_assets_cs);
         {
@@ -342,7 +314,7 @@ Asset_Id find_or_load_asset(Asset_Catalog *catalog, const char *path, const char
     {  
         uint64_t size = 0;
         void *data = os_read_entire_file(path, &size, asset_allocator);
-        void *descriptor = c_alloc(asset_allocator, catalog->descriptor_size);
+        void *descriptor = c_alloc(catalog->descriptor_pool, catalog->descriptor_size);
         bool success = data && callbacks->asset_load(data, size, descriptor);
         if (success)
         {
@@ -365,7 +337,7 @@ Asset_Id find_or_load_asset(Asset_Catalog *catalog, const char *path, const char
                 memcpy(asset, fallback, catalog->asset_size);
             }
         }
-        c_free(asset_allocator, descriptor, catalog->descriptor_size);
+        c_free(catalog->descriptor_pool, descriptor, catalog->descriptor_size);
         c_free(asset_allocator, data, size);
     }
     return asset_id;
@@ -392,7 +364,7 @@ void *asset_data(Asset_Catalog *catalog, Asset_Id asset_id)
 {
     if (private__is_asset_valid(catalog, asset_id))
     {
-        return (uint8_t *)catalog->data + catalog->asset_size * asset_id.index;
+        return paged_array_get(&catalog->data, asset_id.index);
     }
     return 0;
 }
@@ -464,7 +436,7 @@ void poll_async_assets()
                 memcpy(asset, fallback, catalog->asset_size);
             }
         }
-        c_free(it->allocator, it->descriptor, catalog->descriptor_size);
+        c_free(catalog->descriptor_pool, it->descriptor, catalog->descriptor_size);
         c_free(it->allocator, it->data, it->size);
     }
 
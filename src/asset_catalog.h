@@ -23,7 +23,8 @@ typedef struct Asset_Catalog_Interface {
     Asset_Catalog_Callbacks callbacks;
 } Asset_Catalog_Interface;
 
-// Create a new asset catalog that can fit up to `reserve_count` assets
+// Create a new asset catalog sized for about `reserve_count` assets, it grows past that as needed.
+// Pointers returned by `asset_data()` stay valid until the asset is freed.
 Asset_Catalog *make_asset_catalog(uint64_t reserve_count, Asset_Catalog_Interface *i);
 
 // Sets the placeholder asset
@@ -1,4 +1,8 @@
+#pragma once
 #include <stdint.h>
+#include <stdbool.h>
+
+#if defined(OS_WINDOWS)
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
@@ -26,4 +30,126 @@ static inline uint32_t atomic_fetch_add_32(volatile AtomicU32 *obj, uint32_t val
 static inline uint32_t atomic_fetch_sub_32(volatile AtomicU32 *obj, uint32_t value)
 {
     return InterlockedExchangeAdd((volatile LONG *)obj, -(int32_t)value);
-}
\ No newline at end of file
+}
+
+static inline uint64_t atomic_exchange_64(volatile AtomicU64 *obj, uint64_t value)
+{
+    return InterlockedExchange64((volatile LONG64 *)obj, value);
+}
+
+static inline uint32_t atomic_exchange_32(volatile AtomicU32 *obj, uint32_t value)
+{
+    return InterlockedExchange((volatile LONG *)obj, value);
+}
+
+// Returns the value of `obj` prior to the exchange, the exchange happened if it equals `expected`
+static inline uint64_t atomic_compare_exchange_64(volatile AtomicU64 *obj, uint64_t expected, uint64_t desired)
+{
+    return InterlockedCompareExchange64((volatile LONG64 *)obj, desired, expected);
+}
+
+static inline uint32_t atomic_compare_exchange_32(volatile AtomicU32 *obj, uint32_t expected, uint32_t desired)
+{
+    return InterlockedCompareExchange((volatile LONG *)obj, desired, expected);
+}
+
+// Volatile accesses have acquire/release semantics on x64 with MSVC
+static inline uint64_t atomic_load_64(const volatile AtomicU64 *obj)
+{
+    return *obj;
+}
+
+static inline uint32_t atomic_load_32(const volatile AtomicU32 *obj)
+{
+    return *obj;
+}
+
+static inline void atomic_store_64(volatile AtomicU64 *obj, uint64_t value)
+{
+    *obj = value;
+}
+
+static inline void atomic_store_32(volatile AtomicU32 *obj, uint32_t value)
+{
+    *obj = value;
+}
+
+static inline void atomic_memory_barrier()
+{
+    MemoryBarrier();
+}
+
+#else
+
+typedef uint64_t AtomicU64;
+typedef uint32_t AtomicU32;
+
+static inline uint64_t atomic_fetch_add_64(volatile AtomicU64 *obj, uint64_t value)
+{
+    return __atomic_fetch_add(obj, value, __ATOMIC_SEQ_CST);
+}
+
+static inline uint64_t atomic_fetch_sub_64(volatile AtomicU64 *obj, uint64_t value)
+{
+    return __atomic_fetch_sub(obj, value, __ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t atomic_fetch_add_32(volatile AtomicU32 *obj, uint32_t value)
+{
+    return __atomic_fetch_add(obj, value, __ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t atomic_fetch_sub_32(volatile AtomicU32 *obj, uint32_t value)
+{
+    return __atomic_fetch_sub(obj, value, __ATOMIC_SEQ_CST);
+}
+
+static inline uint64_t atomic_exchange_64(volatile AtomicU64 *obj, uint64_t value)
+{
+    return __atomic_exchange_n(obj, value, __ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t atomic_exchange_32(volatile AtomicU32 *obj, uint32_t value)
+{
+    return __atomic_exchange_n(obj, value, __ATOMIC_SEQ_CST);
+}
+
+// Returns the value of `obj` prior to the exchange, the exchange happened if it equals `expected`
+static inline uint64_t atomic_compare_exchange_64(volatile AtomicU64 *obj, uint64_t expected, uint64_t desired)
+{
+    __atomic_compare_exchange_n(obj, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return expected;
+}
+
+static inline uint32_t atomic_compare_exchange_32(volatile AtomicU32 *obj, uint32_t expected, uint32_t desired)
+{
+    __atomic_compare_exchange_n(obj, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return expected;
+}
+
+static inline uint64_t atomic_load_64(const volatile AtomicU64 *obj)
+{
+    return __atomic_load_n(obj, __ATOMIC_ACQUIRE);
+}
+
+static inline uint32_t atomic_load_32(const volatile AtomicU32 *obj)
+{
+    return __atomic_load_n(obj, __ATOMIC_ACQUIRE);
+}
+
+static inline void atomic_store_64(volatile AtomicU64 *obj, uint64_t value)
+{
+    __atomic_store_n(obj, value, __ATOMIC_RELEASE);
+}
+
+static inline void atomic_store_32(volatile AtomicU32 *obj, uint32_t value)
+{
+    __atomic_store_n(obj, value, __ATOMIC_RELEASE);
+}
+
+static inline void atomic_memory_barrier()
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+#endif
@@ -1,6 +1,7 @@
 #pragma once
 #include <stdint.h>
 #include <stdbool.h>
+#include <assert.h>
 
 /* Math types */
 
@@ -71,6 +72,64 @@ typedef struct Time_Stamp {
 
 #define STATIC_ASSERT(x) static_assert(x, #x)
 
+#if defined(_MSC_VER)
+    #define THREAD_LOCAL __declspec(thread)
+    #define NO_INLINE __declspec(noinline)
+#else
+    #define THREAD_LOCAL __thread
+    #define NO_INLINE __attribute__((noinline))
+#endif
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+#endif
+
+// Index of the lowest or highest set bit, `x` must not be 0
+
+static inline uint32_t c_lowest_bit32(uint32_t x)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, x);
+    return (uint32_t)index;
+#else
+    return (uint32_t)__builtin_ctz(x);
+#endif
+}
+
+static inline uint32_t c_highest_bit32(uint32_t x)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse(&index, x);
+    return (uint32_t)index;
+#else
+    return 31 - (uint32_t)__builtin_clz(x);
+#endif
+}
+
+static inline uint32_t c_lowest_bit64(uint64_t x)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, x);
+    return (uint32_t)index;
+#else
+    return (uint32_t)__builtin_ctzll(x);
+#endif
+}
+
+static inline uint32_t c_highest_bit64(uint64_t x)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse64(&index, x);
+    return (uint32_t)index;
+#else
+    return 63 - (uint32_t)__builtin_clzll(x);
+#endif
+}
+
 // Static array count
 #define ARRAY_COUNT(a) (sizeof(a) / sizeof(a[0]))
 
@@ -81,7 +140,7 @@ typedef struct Time_Stamp {
 // Graphics resource identifier
 typedef uint32_t gfx_id;
 
-#define INVALID_ASSET_ID 0xffffffffffffffffui64
+#define INVALID_ASSET_ID 0xffffffffffffffffULL
 
 // Asset identifier
 typedef union Asset_Id {
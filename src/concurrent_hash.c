@@ -0,0 +1,250 @@
+#include "concurrent_hash.h"
+#include "allocator.h"
+#include "log.h"
+#include "atomics.inl"
+#include <string.h>
+
+typedef struct Concurrent_Hash_Table {
+    // Power of two
+    uint32_t num_buckets;
+    // Only written with the write lock held, `num_used` is read atomically by `concurrent_hash_size()`
+    AtomicU32 num_used;
+    uint32_t num_tombstones;
+    struct Concurrent_Hash_Table *next_retired;
+    // `num_buckets` keys followed by `num_buckets` values
+    AtomicU64 slots[];
+} Concurrent_Hash_Table;
+
+static inline uint64_t private__mix(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static inline uint64_t private__table_size(uint32_t num_buckets)
+{
+    return sizeof(Concurrent_Hash_Table) + 2 * (uint64_t)num_buckets * sizeof(AtomicU64);
+}
+
+static inline Concurrent_Hash_Table *private__table(const Concurrent_Hash *hash)
+{
+    return (Concurrent_Hash_Table *)(uintptr_t)atomic_load_64((AtomicU64 *)&hash->table);
+}
+
+// Used keys and tombstones are kept at or below 3/4 of the buckets, so probes are short and end
+static inline uint32_t private__max_load(uint32_t num_buckets)
+{
+    return num_buckets - num_buckets / 4;
+}
+
+static Concurrent_Hash_Table *private__create_table(uint32_t num_buckets, Allocator *a)
+{
+    Concurrent_Hash_Table *t = c_alloc(a, private__table_size(num_buckets));
+    t->num_buckets = num_buckets;
+    t->num_used = 0;
+    t->num_tombstones = 0;
+    t->next_retired = 0;
+    memset(t->slots, 0xff, num_buckets * sizeof(AtomicU64));
+    return t;
+}
+
+// Bucket holding `key` or the unused bucket that ends its probe, `UINT32_MAX` if neither was found
+static uint32_t private__find(const Concurrent_Hash_Table *t, uint64_t key)
+{
+    const uint32_t mask = t->num_buckets - 1;
+    uint32_t i = (uint32_t)private__mix(key) & mask;
+    for (uint32_t n = 0; n < t->num_buckets; ++n)
+    {
+        const uint64_t k = atomic_load_64(&t->slots[i]);
+        if (k == key || k == CONCURRENT_HASH_UNUSED)
+        {
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+    return UINT32_MAX;
+}
+
+// Returns true and the value of `key` if it exists
+static bool private__lookup(const Concurrent_Hash *hash, uint64_t key, uint64_t *value)
+{
+    const Concurrent_Hash_Table *t = private__table(hash);
+    if (key >= CONCURRENT_HASH_TOMBSTONE)
+    {
+        return false;
+    }
+
+    const uint32_t i = private__find(t, key);
+    if (i == UINT32_MAX || atomic_load_64(&t->slots[i]) != key)
+    {
+        return false;
+    }
+    *value = atomic_load_64(&t->slots[t->num_buckets + i]);
+    return true;
+}
+
+// Called with the write lock held. Readers keep probing the old table until the new one is
+// published, it holds every key of the old one since writers are locked out meanwhile.
+static Concurrent_Hash_Table *private__grow(Concurrent_Hash *hash, Concurrent_Hash_Table *t)
+{
+    uint32_t num_buckets = 16;
+    while (private__max_load(num_buckets) < (t->num_used + 1) * 2)
+    {
+        num_buckets *= 2;
+    }
+
+    Concurrent_Hash_Table *new_t = private__create_table(num_buckets, hash->allocator);
+    for (uint32_t i = 0; i < t->num_buckets; ++i)
+    {
+        const uint64_t key = atomic_load_64(&t->slots[i]);
+        if (key < CONCURRENT_HASH_TOMBSTONE)
+        {
+            const uint32_t j = private__find(new_t, key);
+            atomic_store_64(&new_t->slots[new_t->num_buckets + j], atomic_load_64(&t->slots[t->num_buckets + i]));
+            atomic_store_64(&new_t->slots[j], key);
+            new_t->num_used += 1;
+        }
+    }
+
+    atomic_store_64(&hash->table, (uint64_t)(uintptr_t)new_t);
+    t->next_retired = hash->retired;
+    hash->retired = t;
+    return new_t;
+}
+
+void concurrent_hash_init(Concurrent_Hash *hash, uint32_t reserve_count, Allocator *a)
+{
+    uint32_t num_buckets = 16;
+    while (private__max_load(num_buckets) < reserve_count)
+    {
+        num_buckets *= 2;
+    }
+
+    hash->table = (uint64_t)(uintptr_t)private__create_table(num_buckets, a);
+    hash->retired = 0;
+    hash->allocator = a;
+    os_create_critical_section(&hash->write_cs);
+}
+
+void concurrent_hash_free(Concurrent_Hash *hash)
+{
+    concurrent_hash_reclaim(hash);
+    Concurrent_Hash_Table *t = private__table(hash);
+    c_free(hash->allocator, t, private__table_size(t->num_buckets));
+    hash->table = 0;
+}
+
+void concurrent_hash_reclaim(Concurrent_Hash *hash)
+{
+    os_enter_critical_section(&hash->write_cs);
+    Concurrent_Hash_Table *t = hash->retired;
+    hash->retired = 0;
+    os_leave_critical_section(&hash->write_cs);
+
+    while (t)
+    {
+        Concurrent_Hash_Table *next = t->next_retired;
+        c_free(hash->allocator, t, private__table_size(t->num_buckets));
+        t = next;
+    }
+}
+
+bool concurrent_hash_has(const Concurrent_Hash *hash, uint64_t key)
+{
+    uint64_t value;
+    return private__lookup(hash, key, &value);
+}
+
+uint64_t concurrent_hash_get(const Concurrent_Hash *hash, uint64_t key)
+{
+    return concurrent_hash_get_default(hash, key, 0);
+}
+
+uint64_t concurrent_hash_get_default(const Concurrent_Hash *hash, uint64_t key, uint64_t def)
+{
+    uint64_t value;
+    return private__lookup(hash, key, &value) ? value : def;
+}
+
+void concurrent_hash_update(Concurrent_Hash *hash, uint64_t key, uint64_t value)
+{
+    if (key >= CONCURRENT_HASH_TOMBSTONE)
+    {
+        return;
+    }
+
+    os_enter_critical_section(&hash->write_cs);
+    Concurrent_Hash_Table *t = private__table(hash);
+    const uint32_t i = private__find(t, key);
+    if (i != UINT32_MAX && atomic_load_64(&t->slots[i]) == key)
+    {
+        atomic_store_64(&t->slots[t->num_buckets + i], value);
+    }
+    os_leave_critical_section(&hash->write_cs);
+}
+
+void concurrent_hash_add(Concurrent_Hash *hash, uint64_t key, uint64_t value)
+{
+    check(key < CONCURRENT_HASH_TOMBSTONE);
+
+    os_enter_critical_section(&hash->write_cs);
+    Concurrent_Hash_Table *t = private__table(hash);
+    uint32_t i = private__find(t, key);
+    if (i == UINT32_MAX || atomic_load_64(&t->slots[i]) != key)
+    {
+        if (t->num_used + t->num_tombstones + 1 > private__max_load(t->num_buckets))
+        {
+            t = private__grow(hash, t);
+            i = private__find(t, key);
+        }
+        // The value is stored before the key is published
+        atomic_store_64(&t->slots[t->num_buckets + i], value);
+        atomic_store_64(&t->slots[i], key);
+        atomic_store_32(&t->num_used, t->num_used + 1);
+    }
+    else
+    {
+        atomic_store_64(&t->slots[t->num_buckets + i], value);
+    }
+    os_leave_critical_section(&hash->write_cs);
+}
+
+uint64_t concurrent_hash_remove(Concurrent_Hash *hash, uint64_t key)
+{
+    if (key >= CONCURRENT_HASH_TOMBSTONE)
+    {
+        return 0;
+    }
+
+    uint64_t value = 0;
+    os_enter_critical_section(&hash->write_cs);
+    Concurrent_Hash_Table *t = private__table(hash);
+    const uint32_t i = private__find(t, key);
+    if (i != UINT32_MAX && atomic_load_64(&t->slots[i]) == key)
+    {
+        value = atomic_load_64(&t->slots[t->num_buckets + i]);
+        atomic_store_64(&t->slots[i], CONCURRENT_HASH_TOMBSTONE);
+        atomic_store_32(&t->num_used, t->num_used - 1);
+        t->num_tombstones += 1;
+    }
+    os_leave_critical_section(&hash->write_cs);
+    return value;
+}
+
+void concurrent_hash_clear(Concurrent_Hash *hash)
+{
+    os_enter_critical_section(&hash->write_cs);
+    Concurrent_Hash_Table *t = private__table(hash);
+    Concurrent_Hash_Table *new_t = private__create_table(t->num_buckets, hash->allocator);
+    atomic_store_64(&hash->table, (uint64_t)(uintptr_t)new_t);
+    t->next_retired = hash->retired;
+    hash->retired = t;
+    os_leave_critical_section(&hash->write_cs);
+}
+
+uint32_t concurrent_hash_size(const Concurrent_Hash *hash)
+{
+    return atomic_load_32(&private__table(hash)->num_used);
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include "basic.h"
+#include "os.h"
+
+struct Allocator;
+
+// Keys reserved by `Concurrent_Hash`
+#define CONCURRENT_HASH_TOMBSTONE 0xfffffffffffffffeULL
+#define CONCURRENT_HASH_UNUSED 0xffffffffffffffffULL
+
+// Hash from `uint64_t` to `uint64_t` that any number of threads can read while others write.
+// Lookups are wait-free: they never lock and finish in a bounded number of steps. Writers are
+// serialized by a lock. A bucket only ever holds one key, so a removed key's bucket isn't reused
+// until the table is copied, and a reader never sees a key with another key's value.
+// Tables replaced by a grow stay allocated until `concurrent_hash_reclaim()`, since readers may
+// still be probing them.
+typedef struct Concurrent_Hash {
+    // Current `Concurrent_Hash_Table`, swapped atomically on a grow
+    uint64_t table;
+    struct Concurrent_Hash_Table *retired;
+    Critical_Section write_cs;
+    struct Allocator *allocator;
+} Concurrent_Hash;
+
+void concurrent_hash_init(Concurrent_Hash *hash, uint32_t reserve_count, struct Allocator *a);
+
+// No other thread may use the hash
+void concurrent_hash_free(Concurrent_Hash *hash);
+
+// Frees the tables replaced by grows. Call it at a point where no thread is in a lookup, e.g. after
+// the jobs reading the hash have finished.
+void concurrent_hash_reclaim(Concurrent_Hash *hash);
+
+bool concurrent_hash_has(const Concurrent_Hash *hash, uint64_t key);
+
+// Get the value at `key` if it exists, otherwise 0
+uint64_t concurrent_hash_get(const Concurrent_Hash *hash, uint64_t key);
+
+// Get the value at `key` if it exists, otherwise the default value `def`
+uint64_t concurrent_hash_get_default(const Concurrent_Hash *hash, uint64_t key, uint64_t def);
+
+// Update the value stored at `key` if it exists
+void concurrent_hash_update(Concurrent_Hash *hash, uint64_t key, uint64_t value);
+
+// Add `key` or update its value, `key` must not be one of the reserved keys
+void concurrent_hash_add(Concurrent_Hash *hash, uint64_t key, uint64_t value);
+
+// Remove the value stored at `key` and return it, 0 if there was none
+uint64_t concurrent_hash_remove(Concurrent_Hash *hash, uint64_t key);
+
+// Remove all keys
+void concurrent_hash_clear(Concurrent_Hash *hash);
+
+// Number of keys, exact when no writer is active
+uint32_t concurrent_hash_size(const Concurrent_Hash *hash);
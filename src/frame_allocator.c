@@ -1,37 +1,281 @@
 #include "frame_allocator.h"
 #include "allocator.h"
+#include "os.h"
+#include "atomics.inl"
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
 
+enum {
+    // Block sizes are always `PAGE_SIZE` times a power of two
+    FA_NUM_BUCKETS = 32,
+    // Number of recycled frames between each trim of the block cache
+    FA_TRIM_WINDOW = 64,
+    // Blocks of the preferred size that survive a trim
+    FA_MAX_CACHED_BLOCKS = 2,
+};
+
 typedef struct Frame_Allocator_Block
 {
     uint64_t size;
     uint64_t last_used;
     uint64_t used;
     struct Frame_Allocator_Block *next;
+    struct Frame_Allocator_Thread *owner;
+    // Frame the chain was allocated in and link to the next retired chain, only set on the first block of a chain
+    uint64_t frame;
+    struct Frame_Allocator_Block *next_chain;
 } Frame_Allocator_Block;
 
+// Per-thread state. `current` holds the thread's block chain and is swapped out with an atomic
+// exchange both by the owning thread while it allocates and by `frame_allocator_tick()` when
+// it retires the chain, so whoever holds the chain has exclusive access to it.
+// Retired chains are handed back through `recycled` and their blocks cached by the owner, so a
+// thread whose frame footprint is stable doesn't touch the backing allocator at all.
+// Records of threads that called `frame_allocator_release_thread()` are freed by the tick once
+// none of their chains are in flight anymore.
+typedef struct Frame_Allocator_Thread
+{
+    AtomicU64 current;
+    AtomicU64 recycled;
+    AtomicU32 released;
+    struct Frame_Allocator_Thread *next;
+
+    // Only accessed by `frame_allocator_tick()`
+    bool tick_released;
+    bool has_retired_chains;
+
+    // Only accessed by the owning thread
+    Frame_Allocator_Block *cached_blocks[FA_NUM_BUCKETS];
+    uint64_t block_size; // Size of the first block of a new chain
+    uint64_t peak_used; // High water mark of the current trim window
+    uint32_t window_frames;
+} Frame_Allocator_Thread;
+
 Allocator frame_allocator_backing;
-Frame_Allocator_Block empty = { 0 };
-Frame_Allocator_Block *frame_block = &empty;
-Frame_Allocator_Block *last_frame_block = &empty;
+// 0 = uninitialized, 1 = initializing, 2 = initialized
+static AtomicU32 backing_state = 0;
+
+static uint32_t frame_latency = 1;
+static AtomicU64 frame_index = 0;
+static AtomicU64 frame_threads = 0;
+static AtomicU64 retired_chains = 0;
+static THREAD_LOCAL Frame_Allocator_Thread *frame_thread = 0;
+
+static uint32_t fa__bucket(uint64_t size)
+{
+    uint32_t bucket = 0;
+    while ((uint64_t)PAGE_SIZE << bucket < size)
+    {
+        ++bucket;
+    }
+    return bucket;
+}
 
-static uint64_t frame_allocation_blocks = 0;
+// Smallest block size that fits `bytes`
+static uint64_t fa__block_size_for(uint64_t bytes)
+{
+    return (uint64_t)PAGE_SIZE << fa__bucket(bytes);
+}
 
-static Frame_Allocator_Block *fa__allocate_block(Allocator *backing, uint64_t size)
+static Frame_Allocator_Block *fa__allocate_block(Frame_Allocator_Thread *t, uint64_t size)
 {
-    Frame_Allocator_Block *block = c_alloc(backing, size);
+    // Any cached block that is large enough will do, unless it is larger than the preferred
+    // block size. Those are left in the cache so the next trim can release them.
+    Frame_Allocator_Block *block = 0;
+    const uint32_t first_bucket = fa__bucket(size);
+    const uint32_t last_bucket = c_max(first_bucket, fa__bucket(t->block_size));
+    for (uint32_t i = first_bucket; i <= last_bucket; ++i)
+    {
+        if (t->cached_blocks[i])
+        {
+            block = t->cached_blocks[i];
+            t->cached_blocks[i] = block->next;
+            size = block->size;
+            break;
+        }
+    }
+
+    if (!block)
+    {
+        block = c_alloc(&frame_allocator_backing, size);
+    }
+
     *block = (Frame_Allocator_Block) {
         .size = size,
         .last_used = sizeof(*block),
         .used = sizeof(*block),
+        .owner = t,
     };
     return block;
 }
 
+// Lock-free push. `retired_chains` is only popped by `frame_allocator_tick()` and `recycled`
+// only by its owner, both always take the whole list so there is no ABA problem.
+static void fa__push_chain(volatile AtomicU64 *list, Frame_Allocator_Block *chain)
+{
+    uint64_t head = atomic_load_64(list);
+    while (true)
+    {
+        chain->next_chain = (Frame_Allocator_Block *)head;
+        const uint64_t prev = atomic_compare_exchange_64(list, head, (uint64_t)chain);
+        if (prev == head)
+        {
+            break;
+        }
+        head = prev;
+    }
+}
+
+static void fa__retire_chain(Frame_Allocator_Block *chain)
+{
+    fa__push_chain(&retired_chains, chain);
+}
+
+// Frees cached blocks that don't match the preferred block size, keeping a few that do
+static void fa__trim_cache(Frame_Allocator_Thread *t)
+{
+    const uint32_t keep_bucket = fa__bucket(t->block_size);
+    for (uint32_t i = 0; i < FA_NUM_BUCKETS; ++i)
+    {
+        uint32_t kept = 0;
+        Frame_Allocator_Block **it = &t->cached_blocks[i];
+        while (*it)
+        {
+            Frame_Allocator_Block *block = *it;
+            if (i == keep_bucket && kept < FA_MAX_CACHED_BLOCKS)
+            {
+                ++kept;
+                it = &block->next;
+                continue;
+            }
+            *it = block->next;
+            c_free(&frame_allocator_backing, block, block->size);
+        }
+    }
+}
+
+static void fa__free_blocks(Frame_Allocator_Block *block)
+{
+    while (block)
+    {
+        Frame_Allocator_Block *next = block->next;
+        c_free(&frame_allocator_backing, block, block->size);
+        block = next;
+    }
+}
+
+static void fa__free_chains(Frame_Allocator_Block *chain)
+{
+    while (chain)
+    {
+        Frame_Allocator_Block *next_chain = chain->next_chain;
+        fa__free_blocks(chain);
+        chain = next_chain;
+    }
+}
+
+// Moves the blocks of chains handed back by the tick into the block cache
+static void fa__take_recycled_chains(Frame_Allocator_Thread *t)
+{
+    Frame_Allocator_Block *chain = (Frame_Allocator_Block *)atomic_exchange_64(&t->recycled, 0);
+    while (chain)
+    {
+        Frame_Allocator_Block *next_chain = chain->next_chain;
+
+        uint64_t used = 0;
+        uint32_t num_blocks = 0;
+        for (Frame_Allocator_Block *block = chain; block;)
+        {
+            Frame_Allocator_Block *next = block->next;
+            used += block->used;
+            ++num_blocks;
+            const uint32_t bucket = fa__bucket(block->size);
+            block->next = t->cached_blocks[bucket];
+            t->cached_blocks[bucket] = block;
+            block = next;
+        }
+
+        // The frame didn't fit in one block, coalesce into a single right-sized block from now on
+        if (num_blocks > 1)
+        {
+            t->block_size = c_max(t->block_size, fa__block_size_for(used));
+        }
+
+        t->peak_used = c_max(t->peak_used, used);
+        if (++t->window_frames == FA_TRIM_WINDOW)
+        {
+            // Shrink to what the last window actually needed so memory goes back after load spikes
+            t->block_size = fa__block_size_for(t->peak_used);
+            t->peak_used = 0;
+            t->window_frames = 0;
+            fa__trim_cache(t);
+        }
+
+        chain = next_chain;
+    }
+}
+
+// Defaults the backing allocator to the system allocator, once. Only the function is copied, other
+// threads may already be updating the totals of either allocator.
+static void fa__init_backing()
+{
+    if (atomic_load_32(&backing_state) == 2)
+    {
+        return;
+    }
+
+    if (atomic_compare_exchange_32(&backing_state, 0, 1) == 0)
+    {
+        if (!frame_allocator_backing.allocate_func)
+        {
+            frame_allocator_backing.allocate_func = system_allocator->allocate_func;
+            frame_allocator_backing.user_data = system_allocator->user_data;
+        }
+        atomic_store_32(&backing_state, 2);
+    }
+    while (atomic_load_32(&backing_state) != 2)
+    {
+        os_yield_processor();
+    }
+}
+
+static Frame_Allocator_Thread *fa__thread()
+{
+    if (frame_thread)
+    {
+        return frame_thread;
+    }
+
+    fa__init_backing();
+
+    Frame_Allocator_Thread *t = c_alloc(&frame_allocator_backing, sizeof(*t));
+    memset(t, 0, sizeof(*t));
+    t->block_size = PAGE_SIZE;
+    uint64_t head = atomic_load_64(&frame_threads);
+    while (true)
+    {
+        t->next = (Frame_Allocator_Thread *)head;
+        const uint64_t prev = atomic_compare_exchange_64(&frame_threads, head, (uint64_t)t);
+        if (prev == head)
+        {
+            break;
+        }
+        head = prev;
+    }
+    frame_thread = t;
+    return t;
+}
+
+// Offset of the next allocation in `block` aligned to `align`
+static uint64_t fa__aligned_offset(const Frame_Allocator_Block *block, uint64_t align)
+{
+    const uint64_t address = (uint64_t)(uintptr_t)block + block->used;
+    return block->used + (ALIGN_SIZE(address, align) - address);
+}
+
 static void *fa__block_realloc(Frame_Allocator_Block **first, void *ptr, 
-    uint64_t old_size, uint64_t new_size, Allocator *backing)
+    uint64_t old_size, uint64_t new_size, uint64_t align, Frame_Allocator_Thread *t)
 {
     Frame_Allocator_Block *block = *first;
 
@@ -48,11 +292,12 @@ static void *fa__block_realloc(Frame_Allocator_Block **first, void *ptr,
     }
 
     // Check if allocation fits in block
-    if (block && block->size - block->used >= new_size)
+    const uint64_t offset = block ? fa__aligned_offset(block, align) : 0;
+    if (block && block->size >= offset + new_size)
     {
-        void *res = (char *)block + block->used;
-        block->last_used = block->used;
-        block->used += new_size;
+        void *res = (char *)block + offset;
+        block->last_used = offset;
+        block->used = offset + new_size;
         if (res != ptr && old_size != 0 && new_size != 0)
         {
             memcpy(res, ptr, old_size < new_size ? old_size : new_size);
@@ -60,17 +305,17 @@ static void *fa__block_realloc(Frame_Allocator_Block **first, void *ptr,
         return res;
     }
 
-    uint64_t new_block_size = (block && block->size && block->size * 2 >= PAGE_SIZE) ? (block->size * 2) : PAGE_SIZE;
-    while ((new_block_size - sizeof(Frame_Allocator_Block)) < new_size)
+    uint64_t new_block_size = (block && block->size && block->size * 2 >= PAGE_SIZE) ? (block->size * 2) : t->block_size;
+    while ((new_block_size - sizeof(Frame_Allocator_Block)) < new_size + align)
     {
         new_block_size *= 2;
     }
 
-    Frame_Allocator_Block *new_block = fa__allocate_block(backing, new_block_size);
+    Frame_Allocator_Block *new_block = fa__allocate_block(t, new_block_size);
     new_block->next = block;
     *first = new_block;
 
-    void *res = fa__block_realloc(first, ptr, old_size, new_size, backing);
+    void *res = fa__block_realloc(first, ptr, old_size, new_size, align, t);
     if (res != ptr && old_size != 0)
     {
         memcpy(res, ptr, old_size);
@@ -80,7 +325,7 @@ static void *fa__block_realloc(Frame_Allocator_Block **first, void *ptr,
 }
 
 static void *fa__frame_alloc(Allocator *allocator, void *old_ptr, uint64_t old_size, uint64_t new_size, 
-        const char *file, uint32_t line)
+        uint32_t align, const char *file, uint32_t line)
 {
     if (old_size != 0 && new_size != 0 && new_size <= old_size)
     {
@@ -89,7 +334,7 @@ static void *fa__frame_alloc(Allocator *allocator, void *old_ptr, uint64_t old_s
     void *new_ptr = 0;
     if (new_size != 0)
     {
-        new_ptr = frame_alloc(new_size);
+        new_ptr = frame_alloc_aligned(new_size, align);
     }
     if (old_size != 0 && new_size != 0)
     {
@@ -100,15 +345,83 @@ static void *fa__frame_alloc(Allocator *allocator, void *old_ptr, uint64_t old_s
 
 void *frame_alloc(uint64_t size)
 {
-    if (!frame_allocator_backing.allocate_func)
+    return frame_alloc_aligned(size, ALLOCATOR_DEFAULT_ALIGN);
+}
+
+void *frame_alloc_aligned(uint64_t size, uint32_t align)
+{
+    if (!size)
+    {
+        return 0;
+    }
+
+    Frame_Allocator_Thread *t = fa__thread();
+    const uint64_t frame = atomic_load_64(&frame_index);
+
+    Frame_Allocator_Block *block = (Frame_Allocator_Block *)atomic_exchange_64(&t->current, 0);
+    if (block && block->frame != frame)
+    {
+        // Chain from an earlier frame that the tick didn't get to retire
+        fa__retire_chain(block);
+        block = 0;
+    }
+
+    if (!block)
     {
-        frame_allocator_backing = *system_allocator;
+        fa__take_recycled_chains(t);
     }
-    size = ALIGN_SIZE(size, 8);
-    void *p = fa__block_realloc(&frame_block, (void *)0, 0, size, &frame_allocator_backing);
+
+    void *p = fa__block_realloc(&block, (void *)0, 0, size, align ? align : ALLOCATOR_DEFAULT_ALIGN, t);
+    block->frame = frame;
+
+    atomic_store_64(&t->current, (uint64_t)block);
     return p;
 }
 
+void frame_allocator_release_thread()
+{
+    Frame_Allocator_Thread *t = frame_thread;
+    if (!t)
+    {
+        return;
+    }
+
+    // The current chain may still be in flight, it is freed by the tick once its frame is done
+    Frame_Allocator_Block *block = (Frame_Allocator_Block *)atomic_exchange_64(&t->current, 0);
+    if (block)
+    {
+        fa__retire_chain(block);
+    }
+
+    fa__free_chains((Frame_Allocator_Block *)atomic_exchange_64(&t->recycled, 0));
+    for (uint32_t i = 0; i < FA_NUM_BUCKETS; ++i)
+    {
+        fa__free_blocks(t->cached_blocks[i]);
+        t->cached_blocks[i] = 0;
+    }
+
+    // Set after the last chain was retired, so a tick that sees it also sees that chain
+    atomic_store_32(&t->released, 1);
+    frame_thread = 0;
+}
+
+// Unlinks `t` from `frame_threads`. Only the tick removes records while other threads may push new
+// ones at the head, so only unlinking the head needs a compare exchange.
+static void fa__unlink_thread(Frame_Allocator_Thread *t)
+{
+    if (atomic_compare_exchange_64(&frame_threads, (uint64_t)t, (uint64_t)t->next) == (uint64_t)t)
+    {
+        return;
+    }
+
+    Frame_Allocator_Thread *prev = (Frame_Allocator_Thread *)atomic_load_64(&frame_threads);
+    while (prev->next != t)
+    {
+        prev = prev->next;
+    }
+    prev->next = t->next;
+}
+
 struct Allocator frame_allocator_object = {
     .allocate_func = fa__frame_alloc,
     .user_data = 0,
@@ -120,18 +433,72 @@ struct Allocator *frame_allocator()
 }
 
 void frame_allocator_tick()
-{   
-    if (frame_allocator_backing.allocate_func)
+{
+    const uint64_t frame = atomic_fetch_add_64(&frame_index, 1) + 1;
+
+    // Retire the chains of all threads that aren't allocating right now, the others
+    // retire their own chain on their next allocation. Released threads are noted before the
+    // retired chains are taken, so their last chains are among them.
+    for (Frame_Allocator_Thread *t = (Frame_Allocator_Thread *)atomic_load_64(&frame_threads); t; t = t->next)
     {
-        while (last_frame_block != &empty) 
+        t->tick_released = atomic_load_32(&t->released) != 0;
+        t->has_retired_chains = false;
+        Frame_Allocator_Block *block = (Frame_Allocator_Block *)atomic_exchange_64(&t->current, 0);
+        if (block)
         {
-            Frame_Allocator_Block *next = last_frame_block->next;
-            c_free(&frame_allocator_backing, last_frame_block, last_frame_block->size);
-            last_frame_block = next;
+            fa__retire_chain(block);
         }
-        last_frame_block = frame_block;
-        frame_block = &empty;
     }
+
+    // Hand chains of frames that are no longer in flight back to their threads and put the rest back
+    Frame_Allocator_Block *chain = (Frame_Allocator_Block *)atomic_exchange_64(&retired_chains, 0);
+    while (chain)
+    {
+        Frame_Allocator_Block *next = chain->next_chain;
+        Frame_Allocator_Thread *owner = chain->owner;
+        if (chain->frame + frame_latency < frame)
+        {
+            if (owner->tick_released)
+            {
+                fa__free_blocks(chain);
+            }
+            else
+            {
+                fa__push_chain(&owner->recycled, chain);
+            }
+        }
+        else
+        {
+            owner->has_retired_chains = true;
+            fa__retire_chain(chain);
+        }
+        chain = next;
+    }
+
+    // Free the records of released threads that have no chains left in flight
+    Frame_Allocator_Thread *t = (Frame_Allocator_Thread *)atomic_load_64(&frame_threads);
+    while (t)
+    {
+        Frame_Allocator_Thread *next = t->next;
+        if (t->tick_released && !t->has_retired_chains)
+        {
+            fa__unlink_thread(t);
+            // Chains handed back before the release was noted
+            fa__free_chains((Frame_Allocator_Block *)atomic_exchange_64(&t->recycled, 0));
+            c_free(&frame_allocator_backing, t, sizeof(*t));
+        }
+        t = next;
+    }
+}
+
+void frame_allocator_set_latency(uint32_t frames_in_flight)
+{
+    frame_latency = c_max(frames_in_flight, 1);
+}
+
+uint32_t frame_allocator_latency()
+{
+    return frame_latency;
 }
 
 char *frame_vprintf(const char *format, va_list args)
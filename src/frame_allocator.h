@@ -1,17 +1,33 @@
 #pragma once
 #include "basic.h"
+#include <stdarg.h>
 
 struct Allocator;
 
-// Allocates memory for the current frame
+// Allocates memory for the current frame from the calling thread's frame allocator.
+// Safe to call from any thread without locking.
 void *frame_alloc(uint64_t size);
 
+// `frame_alloc()` with a power of two alignment, 0 for the default alignment
+void *frame_alloc_aligned(uint64_t size, uint32_t align);
+
 // Returns an allocator that uses `frame_alloc()`
 struct Allocator *frame_allocator();
 
-// Ticks a "frame" so that memory allocated by `frame_alloc()` can be freed
+// Ticks a "frame" so that memory allocated by `frame_alloc()` on any thread can be freed.
+// Memory stays valid for the number of ticks set by `frame_allocator_set_latency()` after
+// the frame it was allocated in. Must only be called from one thread at a time.
 void frame_allocator_tick();
 
+// Releases the calling thread's cached blocks, call before a thread that used `frame_alloc()` exits.
+// Memory it allocated stays valid for the usual number of ticks.
+void frame_allocator_release_thread();
+
+// Sets how many frames are in flight after the current one (1 by default), e.g. to keep
+// upload data alive until the GPU has consumed it. Call from the thread that ticks.
+void frame_allocator_set_latency(uint32_t frames_in_flight);
+uint32_t frame_allocator_latency();
+
 // Frame allocator printf
 char *frame_vprintf(const char *format, va_list args);
 char *frame_printf(const char *format, ...);
@@ -3,15 +3,47 @@
 #include "allocator.h"
 
 #include <string.h>
-
-static const uint64_t HASH_TOMBSTONE = 0xfffffffffffffffeULL;
-static const uint64_t HASH_UNUSED = 0xffffffffffffffffULL;
-
+#include <emmintrin.h>
+
+enum {
+    // Control bytes are matched 16 at a time with SSE2
+    HASH_GROUP_WIDTH = 16,
+    // Control byte of a bucket that never held a key, lookups stop at a group that has one
+    HASH_CONTROL_EMPTY = 0x80,
+    // Control byte of a bucket whose key was removed, lookups probe past it
+    HASH_CONTROL_DELETED = 0xfe,
+    // Buckets of the old table moved by every add during an incremental grow
+    HASH_MIGRATE_BUCKETS_PER_ADD = 32,
+};
+
+// Open-addressed hash with a control byte per bucket, which holds the low 7 bits of the mixed key
+// of a used bucket or one of the `HASH_CONTROL_*` values. Lookups compare a whole group of control
+// bytes at once and only read the keys whose bits match. Zero-initialize for an empty hash.
 typedef struct Hash
 {
+    // Power of two and a multiple of `HASH_GROUP_WIDTH`, 0 before the first add
     uint32_t num_buckets;
+    // Alignment of the key and value storage, e.g. 64 for vectorized lookups. 0 for the default
+    uint32_t align;
+    uint32_t num_used;
+    uint32_t num_deleted;
+    // Bucket `i` is at `keys[i]` and `values[i]`, or at index `2 * i` of both if `interleaved`
     uint64_t *keys;
     uint64_t *values;
+    uint8_t *control;
+
+    // Opt-in, set before the first add. Stores each key next to its value so that a hit costs one
+    // cache miss instead of two.
+    bool interleaved;
+
+    // Opt-in, set before the first add. A grow allocates the new table but leaves the keys in the
+    // old one, every add then moves `HASH_MIGRATE_BUCKETS_PER_ADD` buckets and `hash_migrate()`
+    // moves more at a convenient time. Lookups check both tables until all buckets are moved.
+    bool incremental;
+    // Old table of an incremental grow, its buckets below `migrate_index` have been moved
+    uint32_t old_num_buckets;
+    uint32_t migrate_index;
+    uint64_t *old_keys;
 } Hash;
 
 // Check if the hash contains `key`
@@ -26,7 +58,7 @@ static inline uint64_t hash_get_default(const Hash *hash, uint64_t key, uint64_t
 // Update the value stored at `key`
 static inline void hash_update(Hash *hash, uint64_t key, uint64_t value);
 
-// Add or probe a new slot for `key` 
+// Add or probe a new slot for `key`
 static inline uint64_t *hash_add_reference(Hash *hash, uint64_t key, Allocator *a);
 
 // Shorthand for *hash_add_reference(hash, key) = value;
@@ -41,117 +73,345 @@ static inline void hash_clear(Hash *hash);
 // Release all memory of `hash`
 static inline void hash_free(Hash *hash, Allocator *a);
 
-static inline uint32_t hash__first_index(const Hash *hash, uint64_t key)
+// Moves up to `budget` buckets of an incremental grow to the new table. Returns true while buckets
+// are left to move.
+static inline bool hash_migrate(Hash *hash, uint32_t budget, Allocator *a);
+
+// Looks up `n` keys and writes their values to `values`, or `def` for missing keys. Hashes and
+// prefetches a batch of keys before probing, so the cache misses of the batch overlap.
+static inline void hash_get_many(const Hash *hash, const uint64_t *keys, uint32_t n, uint64_t *values, uint64_t def);
+
+// Writes to `results` whether the hash contains each of the `n` keys, batched like `hash_get_many()`
+static inline void hash_has_many(const Hash *hash, const uint64_t *keys, uint32_t n, bool *results);
+
+// Keys are often pointers or small integers, so spread their entropy over all bits before the
+// low bits pick the control byte and the high bits the group
+static inline uint64_t hash__mix(uint64_t key)
 {
-    return key % hash->num_buckets;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
 }
 
-static inline uint32_t hash__next_index(const Hash *hash, uint32_t i)
+static inline uint8_t hash__control_byte(uint64_t h)
 {
-    return (i + 1) % hash->num_buckets;
+    return (uint8_t)(h & 0x7f);
 }
 
-static inline uint32_t hash__index(const Hash *hash, uint64_t key)
+static inline uint32_t hash__first_group(uint32_t num_buckets, uint64_t h)
+{
+    return (uint32_t)(h >> 7) & (num_buckets / HASH_GROUP_WIDTH - 1);
+}
+
+// Triangular steps visit every group once since the number of groups is a power of two
+static inline uint32_t hash__next_group(uint32_t num_buckets, uint32_t group, uint32_t step)
+{
+    return (group + step + 1) & (num_buckets / HASH_GROUP_WIDTH - 1);
+}
+
+// Bit `i` is set if control byte `i` of the group is `c`
+static inline uint32_t hash__group_match(const uint8_t *group, uint8_t c)
+{
+    const __m128i g = _mm_loadu_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)c)));
+}
+
+// Bit `i` is set if bucket `i` of the group is empty or deleted, which both have the high bit set
+static inline uint32_t hash__group_match_free(const uint8_t *group)
+{
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+}
+
+// Used and deleted buckets are kept below 7/8 of the buckets so every probe reaches an empty one
+static inline uint32_t hash__max_load(uint32_t num_buckets)
+{
+    return num_buckets - num_buckets / 8;
+}
+
+static inline uint64_t hash__bytes(uint32_t num_buckets)
+{
+    return (uint64_t)num_buckets * (sizeof(uint64_t) + sizeof(uint64_t) + sizeof(uint8_t));
+}
+
+static inline uint64_t *hash__key_at(const Hash *hash, uint32_t i)
+{
+    return hash->keys + ((uint64_t)i << hash->interleaved);
+}
+
+static inline uint64_t *hash__value_at(const Hash *hash, uint32_t i)
+{
+    return hash->values + ((uint64_t)i << hash->interleaved);
+}
+
+// Index of `key`, whose mixed hash is `h`, or `UINT32_MAX`
+static inline uint32_t hash__index_mixed(const Hash *hash, uint64_t key, uint64_t h)
 {
-    if (!hash->num_buckets || key >= HASH_TOMBSTONE)
+    if (!hash->num_buckets)
         return UINT32_MAX;
 
-    const uint32_t max_distance = 6;
+    const uint8_t c = hash__control_byte(h);
+    const uint32_t num_groups = hash->num_buckets / HASH_GROUP_WIDTH;
 
-    uint32_t i = hash__first_index(hash, key);
-    uint32_t distance = 0;
-    while (hash->keys[i] != key)
+    uint32_t group = hash__first_group(hash->num_buckets, h);
+    for (uint32_t step = 0; step < num_groups; ++step)
     {
-        if (distance > max_distance)
-            return UINT32_MAX;
-        if (hash->keys[i] == HASH_UNUSED)
+        const uint8_t *control = hash->control + group * HASH_GROUP_WIDTH;
+        uint32_t match = hash__group_match(control, c);
+        while (match)
+        {
+            const uint32_t i = group * HASH_GROUP_WIDTH + c_lowest_bit32(match);
+            if (*hash__key_at(hash, i) == key)
+                return i;
+            match &= match - 1;
+        }
+        if (hash__group_match(control, HASH_CONTROL_EMPTY))
             return UINT32_MAX;
-        i = hash__next_index(hash, i);
-        ++distance;
+        group = hash__next_group(hash->num_buckets, group, step);
     }
+    return UINT32_MAX;
+}
+
+static inline uint32_t hash__index(const Hash *hash, uint64_t key)
+{
+    return hash__index_mixed(hash, key, hash__mix(key));
+}
+
+// First empty or deleted bucket on the probe sequence of `h`, the load factor guarantees there is one
+static inline uint32_t hash__free_index(const uint8_t *control, uint32_t num_buckets, uint64_t h)
+{
+    uint32_t group = hash__first_group(num_buckets, h);
+    for (uint32_t step = 0; ; ++step)
+    {
+        const uint32_t free = hash__group_match_free(control + group * HASH_GROUP_WIDTH);
+        if (free)
+            return group * HASH_GROUP_WIDTH + c_lowest_bit32(free);
+        group = hash__next_group(num_buckets, group, step);
+    }
+}
+
+// Marks bucket `i` as no longer used and returns true if it had to be marked deleted.
+// Lookups stop at a group with an empty bucket, so no probe ever continued past this group and
+// the bucket can be empty rather than deleted. A group without one never regains one until the
+// table is rehashed, which keeps that true.
+static inline bool hash__release_bucket(uint8_t *control, uint32_t i)
+{
+    const uint8_t *group = control + i / HASH_GROUP_WIDTH * HASH_GROUP_WIDTH;
+    const bool deleted = !hash__group_match(group, HASH_CONTROL_EMPTY);
+    control[i] = deleted ? HASH_CONTROL_DELETED : HASH_CONTROL_EMPTY;
+    return deleted;
+}
+
+// Stores `key`, which must not be in the hash, in a free bucket
+static inline uint32_t hash__insert(Hash *hash, uint64_t key, uint64_t value)
+{
+    const uint64_t h = hash__mix(key);
+    const uint32_t i = hash__free_index(hash->control, hash->num_buckets, h);
+    if (hash->control[i] == HASH_CONTROL_DELETED)
+        --hash->num_deleted;
+    hash->control[i] = hash__control_byte(h);
+    *hash__key_at(hash, i) = key;
+    *hash__value_at(hash, i) = value;
+    ++hash->num_used;
     return i;
 }
 
-static inline uint32_t hash__add_index(Hash *hash, uint64_t key)
+// Places every key again in the same buckets, which turns all deleted buckets back into empty ones
+// without allocating
+static inline void hash__rehash_in_place(Hash *hash)
 {
-    const uint32_t max_distance = 6;
+    // Used buckets are marked deleted until they are placed, deleted buckets become empty
+    for (uint32_t i = 0; i < hash->num_buckets; ++i)
+        hash->control[i] = hash->control[i] & HASH_CONTROL_EMPTY ? HASH_CONTROL_EMPTY : HASH_CONTROL_DELETED;
 
-    if (!hash->num_buckets)
-        return UINT32_MAX;
+    for (uint32_t i = 0; i < hash->num_buckets; ++i)
+    {
+        while (hash->control[i] == HASH_CONTROL_DELETED)
+        {
+            const uint64_t h = hash__mix(*hash__key_at(hash, i));
+            const uint32_t target = hash__free_index(hash->control, hash->num_buckets, h);
+            if (target / HASH_GROUP_WIDTH == i / HASH_GROUP_WIDTH)
+            {
+                hash->control[i] = hash__control_byte(h);
+                break;
+            }
+
+            const uint64_t key = *hash__key_at(hash, i);
+            const uint64_t value = *hash__value_at(hash, i);
+            if (hash->control[target] == HASH_CONTROL_EMPTY)
+            {
+                hash->control[i] = HASH_CONTROL_EMPTY;
+            }
+            else
+            {
+                // The target holds a key that still needs to be placed, swap and place that one next
+                *hash__key_at(hash, i) = *hash__key_at(hash, target);
+                *hash__value_at(hash, i) = *hash__value_at(hash, target);
+            }
+            hash->control[target] = hash__control_byte(h);
+            *hash__key_at(hash, target) = key;
+            *hash__value_at(hash, target) = value;
+        }
+    }
+    hash->num_deleted = 0;
+}
+
+static inline void hash__set_storage(Hash *hash, uint64_t *keys, uint32_t num_buckets)
+{
+    hash->num_buckets = num_buckets;
+    hash->keys = keys;
+    hash->values = hash->interleaved ? keys + 1 : keys + num_buckets;
+    hash->control = (uint8_t *)(keys + 2 * (uint64_t)num_buckets);
+}
+
+// View of the old table during an incremental grow, its counters are meaningless
+static inline Hash hash__old_table(const Hash *hash)
+{
+    Hash old = { .interleaved = hash->interleaved };
+    hash__set_storage(&old, hash->old_keys, hash->old_num_buckets);
+    return old;
+}
 
-    uint32_t i = hash__first_index(hash, key);
-    uint32_t distance = 0;
-    while (hash->keys[i] != HASH_UNUSED && hash->keys[i] != HASH_TOMBSTONE)
+static inline bool hash__migrating(const Hash *hash)
+{
+    return hash->migrate_index < hash->old_num_buckets;
+}
+
+// Value of `key` in either table, 0 if there's none
+static inline uint64_t *hash__value(const Hash *hash, uint64_t key)
+{
+    const uint32_t i = hash__index(hash, key);
+    if (i != UINT32_MAX)
+        return hash__value_at(hash, i);
+
+    if (hash__migrating(hash))
     {
-        if (distance > max_distance)
-            return UINT32_MAX;
-        i = hash__next_index(hash, i);
-        ++distance;
+        const Hash old = hash__old_table(hash);
+        const uint32_t j = hash__index(&old, key);
+        if (j != UINT32_MAX)
+            return hash__value_at(&old, j);
     }
-    return i;
+    return 0;
 }
 
-static inline void hash__grow(Hash *hash, Allocator *a)
+static inline void hash__remove_index(Hash *hash, uint32_t i)
+{
+    if (hash__release_bucket(hash->control, i))
+        ++hash->num_deleted;
+    --hash->num_used;
+}
+
+// Moves every key of the current table to a new one with `new_buckets` buckets at once. The old
+// table of an incremental grow is left as is, its remaining keys are migrated into the new table.
+static inline void hash__resize(Hash *hash, uint32_t new_buckets, Allocator *a)
 {
-    uint32_t new_buckets = (hash->num_buckets * 2) + 11;
     Hash new_hash = *hash;
-    new_hash.num_buckets = new_buckets;
-    new_hash.keys = c_alloc(a, new_buckets * (sizeof(*hash->keys) + sizeof(*hash->values)));
-    new_hash.values = new_hash.keys + new_hash.num_buckets;
-    hash_clear(&new_hash);
+    hash__set_storage(&new_hash, c_alloc_aligned(a, hash__bytes(new_buckets), hash->align), new_buckets);
+    memset(new_hash.control, HASH_CONTROL_EMPTY, new_buckets);
+    new_hash.num_used = 0;
+    new_hash.num_deleted = 0;
     for (uint32_t i = 0; i < hash->num_buckets; ++i)
     {
-        if (hash->keys[i] != HASH_UNUSED && hash->keys[i] != HASH_TOMBSTONE)
-            hash_add(&new_hash, hash->keys[i], hash->values[i], a);
-    }	
-    hash_free(hash, a);
+        if (!(hash->control[i] & HASH_CONTROL_EMPTY))
+            hash__insert(&new_hash, *hash__key_at(hash, i), *hash__value_at(hash, i));
+    }
+    if (hash->num_buckets)
+        c_free_aligned(a, hash->keys, hash__bytes(hash->num_buckets), hash->align);
     *hash = new_hash;
 }
 
+// Called when used and deleted buckets reach the maximum load. Rehashes into a table with at least
+// twice as many buckets as used ones, in place if that is the current size, i.e. when most of the
+// load was deleted buckets.
+static inline void hash__grow(Hash *hash, Allocator *a)
+{
+    // The new table of an incremental grow filled up before the old one was empty
+    while (hash_migrate(hash, UINT32_MAX, a)) {}
+
+    uint32_t new_buckets = HASH_GROUP_WIDTH;
+    while (new_buckets < (hash->num_used + 1) * 2)
+        new_buckets *= 2;
+
+    // An incremental grow never shrinks the table. Adds during the migration land in the new table
+    // next to the keys still to be moved, which a smaller table might not fit. At the same size the
+    // table is rehashed in place instead.
+    if (hash->incremental && new_buckets < hash->num_buckets)
+        new_buckets = hash->num_buckets;
+
+    if (new_buckets == hash->num_buckets)
+    {
+        hash__rehash_in_place(hash);
+        return;
+    }
+
+    if (hash->incremental && hash->num_used)
+    {
+        Hash new_hash = *hash;
+        hash__set_storage(&new_hash, c_alloc_aligned(a, hash__bytes(new_buckets), hash->align), new_buckets);
+        hash_clear(&new_hash);
+        new_hash.old_keys = hash->keys;
+        new_hash.old_num_buckets = hash->num_buckets;
+        new_hash.migrate_index = 0;
+        *hash = new_hash;
+        return;
+    }
+
+    hash__resize(hash, new_buckets, a);
+}
+
 static inline bool hash_has(const Hash *hash, uint64_t key)
 {
-    return hash__index(hash, key) != UINT32_MAX;
+    return hash__value(hash, key) != 0;
 }
 
 static inline uint64_t hash_get(const Hash *hash, uint64_t key)
 {
-    const uint32_t i = hash__index(hash, key);
-    return i != UINT32_MAX ? hash->values[i] : 0;
+    const uint64_t *value = hash__value(hash, key);
+    return value ? *value : 0;
 }
 
 static inline uint64_t hash_get_default(const Hash *hash, uint64_t key, uint64_t def)
 {
-    const uint32_t i = hash__index(hash, key);
-    return i != UINT32_MAX ? hash->values[i] : def;
+    const uint64_t *value = hash__value(hash, key);
+    return value ? *value : def;
 }
 
 static inline void hash_update(Hash *hash, uint64_t key, uint64_t value)
 {
-    uint32_t i = hash__index(hash, key);
-    if (i != UINT32_MAX)
-        hash->values[i] = value;
+    uint64_t *p = hash__value(hash, key);
+    if (p)
+        *p = value;
 }
 
 static inline uint64_t *hash_add_reference(Hash *hash, uint64_t key, Allocator *a)
 {
     uint32_t i = hash__index(hash, key);
     if (i != UINT32_MAX)
-        return hash->values + i;
+        return hash__value_at(hash, i);
 
-    while (true)
+    // Keys still in the old table move over now, so the returned pointer stays valid like one into
+    // a hash that isn't growing
+    uint64_t value = 0;
+    if (hash__migrating(hash))
     {
-        i = hash__add_index(hash, key);
-        if (i != UINT32_MAX)
-            break;
-        hash__grow(hash, a);
+        Hash old = hash__old_table(hash);
+        const uint32_t j = hash__index(&old, key);
+        if (j != UINT32_MAX)
+        {
+            value = *hash__value_at(&old, j);
+            hash__remove_index(&old, j);
+        }
     }
+    hash_migrate(hash, HASH_MIGRATE_BUCKETS_PER_ADD, a);
+
+    if (hash->num_used + hash->num_deleted >= hash__max_load(hash->num_buckets))
+        hash__grow(hash, a);
 
-    hash->keys[i] = key;
-    hash->values[i] = 0;
-    return hash->values + i;
+    i = hash__insert(hash, key, value);
+    return hash__value_at(hash, i);
 }
 
-static inline void hash_add(Hash *hash, uint64_t key, uint64_t value, Allocator *a) 
+static inline void hash_add(Hash *hash, uint64_t key, uint64_t value, Allocator *a)
 {
     *hash_add_reference(hash, key, a) = value;
 }
@@ -161,21 +421,152 @@ static inline uint64_t hash_remove(Hash *hash, uint64_t key)
     uint32_t i = hash__index(hash, key);
     if (i != UINT32_MAX)
     {
-        hash->keys[i] = HASH_TOMBSTONE;
-        return hash->values[i];
+        hash__remove_index(hash, i);
+        return *hash__value_at(hash, i);
+    }
+
+    if (hash__migrating(hash))
+    {
+        Hash old = hash__old_table(hash);
+        const uint32_t j = hash__index(&old, key);
+        if (j != UINT32_MAX)
+        {
+            hash__remove_index(&old, j);
+            return *hash__value_at(&old, j);
+        }
     }
     return 0;
 }
 
 static inline void hash_clear(Hash *hash)
 {
-    memset(hash->keys, 0xff, hash->num_buckets * (sizeof(*hash->keys) + sizeof(*hash->values)));
+    if (hash->num_buckets)
+        memset(hash->control, HASH_CONTROL_EMPTY, hash->num_buckets);
+    hash->num_used = 0;
+    hash->num_deleted = 0;
+    // Nothing is left to move, the old table is freed by the next call that gets an allocator
+    hash->migrate_index = hash->old_num_buckets;
 }
 
 static inline void hash_free(Hash *hash, Allocator *a)
 {
-    c_free(a, hash->keys, hash->num_buckets * (sizeof(*hash->keys) + sizeof(*hash->values)));
+    if (hash->num_buckets)
+        c_free_aligned(a, hash->keys, hash__bytes(hash->num_buckets), hash->align);
+    if (hash->old_num_buckets)
+        c_free_aligned(a, hash->old_keys, hash__bytes(hash->old_num_buckets), hash->align);
     hash->keys = 0;
     hash->values = 0;
+    hash->control = 0;
     hash->num_buckets = 0;
-}
\ No newline at end of file
+    hash->num_used = 0;
+    hash->num_deleted = 0;
+    hash->old_keys = 0;
+    hash->old_num_buckets = 0;
+    hash->migrate_index = 0;
+}
+
+static inline bool hash_migrate(Hash *hash, uint32_t budget, Allocator *a)
+{
+    if (!hash->old_num_buckets)
+        return false;
+
+    // Moved buckets are marked deleted so that lookups in the old table skip them
+    const Hash old = hash__old_table(hash);
+    const uint32_t end = budget < old.num_buckets - hash->migrate_index ? hash->migrate_index + budget : old.num_buckets;
+    for (uint32_t i = hash->migrate_index; i < end; ++i)
+    {
+        if (!(old.control[i] & HASH_CONTROL_EMPTY))
+        {
+            // The new table was sized for twice the keys, yet adds and removals during the migration
+            // can still fill it up. Reclaim deleted buckets if that frees enough of them, otherwise
+            // grow the new table at once.
+            if (hash->num_used + hash->num_deleted >= hash__max_load(hash->num_buckets))
+            {
+                if (hash->num_used * 2 < hash__max_load(hash->num_buckets))
+                    hash__rehash_in_place(hash);
+                else
+                    hash__resize(hash, hash->num_buckets * 2, a);
+            }
+            hash__insert(hash, *hash__key_at(&old, i), *hash__value_at(&old, i));
+            old.control[i] = HASH_CONTROL_DELETED;
+        }
+    }
+    hash->migrate_index = end;
+
+    if (hash__migrating(hash))
+        return true;
+
+    c_free_aligned(a, hash->old_keys, hash__bytes(hash->old_num_buckets), hash->align);
+    hash->old_keys = 0;
+    hash->old_num_buckets = 0;
+    hash->migrate_index = 0;
+    return false;
+}
+
+enum {
+    // Keys hashed and prefetched ahead of probing by `hash_get_many()` and `hash_has_many()`
+    HASH_LOOKUP_BATCH = 32,
+};
+
+// Resolves `keys` in batches, writing the value or `def` to `values` and whether the key was found
+// to `found`. Either may be 0.
+static inline void hash__lookup_many(const Hash *hash, const uint64_t *keys, uint32_t n, uint64_t *values,
+    bool *found, uint64_t def)
+{
+    uint64_t h[HASH_LOOKUP_BATCH];
+    uint32_t candidate[HASH_LOOKUP_BATCH];
+    for (uint32_t start = 0; start < n; start += HASH_LOOKUP_BATCH)
+    {
+        const uint32_t count = c_min(HASH_LOOKUP_BATCH, n - start);
+        if (hash->num_buckets)
+        {
+            // Fetch the control bytes of every first group, then the key and value of the first
+            // bucket whose control byte matches, most keys are found there
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                h[i] = hash__mix(keys[start + i]);
+                const uint32_t group = hash__first_group(hash->num_buckets, h[i]);
+                _mm_prefetch((const char *)(hash->control + group * HASH_GROUP_WIDTH), _MM_HINT_T0);
+            }
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                const uint32_t group = hash__first_group(hash->num_buckets, h[i]);
+                const uint32_t match = hash__group_match(hash->control + group * HASH_GROUP_WIDTH, hash__control_byte(h[i]));
+                candidate[i] = match ? group * HASH_GROUP_WIDTH + c_lowest_bit32(match) : UINT32_MAX;
+                if (match)
+                {
+                    _mm_prefetch((const char *)hash__key_at(hash, candidate[i]), _MM_HINT_T0);
+                    _mm_prefetch((const char *)hash__value_at(hash, candidate[i]), _MM_HINT_T0);
+                }
+            }
+        }
+
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            const uint64_t key = keys[start + i];
+            uint32_t index = UINT32_MAX;
+            if (hash->num_buckets)
+            {
+                index = candidate[i] != UINT32_MAX && *hash__key_at(hash, candidate[i]) == key
+                    ? candidate[i] : hash__index_mixed(hash, key, h[i]);
+            }
+            const uint64_t *value = index != UINT32_MAX ? hash__value_at(hash, index) : 0;
+            if (!value && hash__migrating(hash))
+                value = hash__value(hash, key);
+            if (values)
+                values[start + i] = value ? *value : def;
+            if (found)
+                found[start + i] = value != 0;
+        }
+    }
+}
+
+static inline void hash_get_many(const Hash *hash, const uint64_t *keys, uint32_t n, uint64_t *values, uint64_t def)
+{
+    hash__lookup_many(hash, keys, n, values, 0, def);
+}
+
+static inline void hash_has_many(const Hash *hash, const uint64_t *keys, uint32_t n, bool *results)
+{
+    hash__lookup_many(hash, keys, n, 0, results, 0);
+}
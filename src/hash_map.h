@@ -0,0 +1,190 @@
+#pragma once
+#include "basic.h"
+#include "allocator.h"
+#include "hash.h"
+#include "murmur_hash64.h"
+
+#include <string.h>
+
+// Declares a hash map type `Name` from `Key` to `Value` and its functions prefixed with `prefix`.
+// Keys and values are stored inline next to each other in `Name_Entry` structs, with the same
+// control bytes and group probing as `Hash`. `hash_func(Key)` returns a `uint64_t` and
+// `equal_func(Key, Key)` a `bool`, a few are provided below. Zero-initialize for an empty map.
+//
+//   HASH_MAP_DECLARE(Name_Map, name_map, String8, Asset_Id, hash_map_hash_string8, hash_map_equal_string8)
+//
+//   Value *prefix_get(const Name *map, Key key)                  Value at `key` or 0
+//   bool prefix_has(const Name *map, Key key)
+//   Value *prefix_add_reference(Name *map, Key key, Allocator *a)  Zeroed if `key` is new
+//   void prefix_add(Name *map, Key key, Value value, Allocator *a)
+//   bool prefix_remove(Name *map, Key key, Value *removed)       `removed` may be 0
+//   void prefix_clear(Name *map)
+//   void prefix_free(Name *map, Allocator *a)
+//
+// Pointers returned by `_get()` and `_add_reference()` are valid until the next add. The map
+// stores keys by value, so the memory behind pointer keys such as `String8` must outlive them.
+// Used buckets can be iterated with `hash_map_is_used()`:
+//
+//   for (uint32_t i = 0; i < map.num_buckets; ++i)
+//       if (hash_map_is_used(&map, i))
+//           ... map.entries[i].key, map.entries[i].value
+#define HASH_MAP_DECLARE(Name, prefix, Key, Value, hash_func, equal_func)                                   \
+                                                                                                            \
+typedef struct Name##_Entry                                                                                 \
+{                                                                                                           \
+    Key key;                                                                                                \
+    Value value;                                                                                            \
+} Name##_Entry;                                                                                             \
+                                                                                                            \
+typedef struct Name                                                                                         \
+{                                                                                                           \
+    uint32_t num_buckets;                                                                                   \
+    uint32_t num_used;                                                                                      \
+    uint32_t num_deleted;                                                                                   \
+    Name##_Entry *entries;                                                                                  \
+    uint8_t *control;                                                                                       \
+} Name;                                                                                                     \
+                                                                                                            \
+static inline uint32_t prefix##__index(const Name *map, Key key, uint64_t h)                                \
+{                                                                                                           \
+    if (!map->num_buckets)                                                                                  \
+        return UINT32_MAX;                                                                                  \
+                                                                                                            \
+    const uint8_t c = hash__control_byte(h);                                                                \
+    const uint32_t num_groups = map->num_buckets / HASH_GROUP_WIDTH;                                        \
+    uint32_t group = hash__first_group(map->num_buckets, h);                                                \
+    for (uint32_t step = 0; step < num_groups; ++step)                                                      \
+    {                                                                                                       \
+        const uint8_t *control = map->control + group * HASH_GROUP_WIDTH;                                   \
+        uint32_t match = hash__group_match(control, c);                                                     \
+        while (match)                                                                                       \
+        {                                                                                                   \
+            const uint32_t i = group * HASH_GROUP_WIDTH + c_lowest_bit32(match);                            \
+            if (equal_func(map->entries[i].key, key))                                                       \
+                return i;                                                                                   \
+            match &= match - 1;                                                                             \
+        }                                                                                                   \
+        if (hash__group_match(control, HASH_CONTROL_EMPTY))                                                 \
+            return UINT32_MAX;                                                                              \
+        group = hash__next_group(map->num_buckets, group, step);                                            \
+    }                                                                                                       \
+    return UINT32_MAX;                                                                                      \
+}                                                                                                           \
+                                                                                                            \
+static inline uint32_t prefix##__insert(Name *map, const Name##_Entry *entry, uint64_t h)                   \
+{                                                                                                           \
+    const uint32_t i = hash__free_index(map->control, map->num_buckets, h);                                 \
+    if (map->control[i] == HASH_CONTROL_DELETED)                                                            \
+        --map->num_deleted;                                                                                 \
+    map->control[i] = hash__control_byte(h);                                                                \
+    map->entries[i] = *entry;                                                                               \
+    ++map->num_used;                                                                                        \
+    return i;                                                                                               \
+}                                                                                                           \
+                                                                                                            \
+static inline void prefix##_free(Name *map, Allocator *a);                                                  \
+                                                                                                            \
+static inline void prefix##_clear(Name *map)                                                                \
+{                                                                                                           \
+    if (map->num_buckets)                                                                                   \
+        memset(map->control, HASH_CONTROL_EMPTY, map->num_buckets);                                         \
+    map->num_used = 0;                                                                                      \
+    map->num_deleted = 0;                                                                                   \
+}                                                                                                           \
+                                                                                                            \
+static inline void prefix##__grow(Name *map, Allocator *a)                                                  \
+{                                                                                                           \
+    uint32_t new_buckets = HASH_GROUP_WIDTH;                                                                \
+    while (new_buckets < (map->num_used + 1) * 2)                                                           \
+        new_buckets *= 2;                                                                                   \
+                                                                                                            \
+    Name new_map = { .num_buckets = new_buckets };                                                          \
+    new_map.entries = c_alloc(a, (uint64_t)new_buckets * (sizeof(Name##_Entry) + 1));                       \
+    new_map.control = (uint8_t *)(new_map.entries + new_buckets);                                           \
+    prefix##_clear(&new_map);                                                                               \
+    for (uint32_t i = 0; i < map->num_buckets; ++i)                                                         \
+    {                                                                                                       \
+        if (!(map->control[i] & HASH_CONTROL_EMPTY))                                                        \
+            prefix##__insert(&new_map, map->entries + i, hash__mix(hash_func(map->entries[i].key)));        \
+    }                                                                                                       \
+    prefix##_free(map, a);                                                                                  \
+    *map = new_map;                                                                                         \
+}                                                                                                           \
+                                                                                                            \
+static inline Value *prefix##_get(const Name *map, Key key)                                                 \
+{                                                                                                           \
+    const uint32_t i = prefix##__index(map, key, hash__mix(hash_func(key)));                                \
+    return i != UINT32_MAX ? &map->entries[i].value : 0;                                                   \
+}                                                                                                           \
+                                                                                                            \
+static inline bool prefix##_has(const Name *map, Key key)                                                   \
+{                                                                                                           \
+    return prefix##__index(map, key, hash__mix(hash_func(key))) != UINT32_MAX;                              \
+}                                                                                                           \
+                                                                                                            \
+static inline Value *prefix##_add_reference(Name *map, Key key, Allocator *a)                               \
+{                                                                                                           \
+    const uint64_t h = hash__mix(hash_func(key));                                                           \
+    uint32_t i = prefix##__index(map, key, h);                                                              \
+    if (i != UINT32_MAX)                                                                                    \
+        return &map->entries[i].value;                                                                      \
+                                                                                                            \
+    if (map->num_used + map->num_deleted >= hash__max_load(map->num_buckets))                               \
+        prefix##__grow(map, a);                                                                             \
+                                                                                                            \
+    Name##_Entry entry;                                                                                     \
+    memset(&entry, 0, sizeof(entry));                                                                       \
+    entry.key = key;                                                                                        \
+    i = prefix##__insert(map, &entry, h);                                                                   \
+    return &map->entries[i].value;                                                                          \
+}                                                                                                           \
+                                                                                                            \
+static inline void prefix##_add(Name *map, Key key, Value value, Allocator *a)                              \
+{                                                                                                           \
+    *prefix##_add_reference(map, key, a) = value;                                                           \
+}                                                                                                           \
+                                                                                                            \
+static inline bool prefix##_remove(Name *map, Key key, Value *removed)                                      \
+{                                                                                                           \
+    const uint32_t i = prefix##__index(map, key, hash__mix(hash_func(key)));                                \
+    if (i == UINT32_MAX)                                                                                    \
+        return false;                                                                                       \
+    if (removed)                                                                                            \
+        *removed = map->entries[i].value;                                                                   \
+    if (hash__release_bucket(map->control, i))                                                              \
+        ++map->num_deleted;                                                                                 \
+    --map->num_used;                                                                                        \
+    return true;                                                                                            \
+}                                                                                                           \
+                                                                                                            \
+static inline void prefix##_free(Name *map, Allocator *a)                                                   \
+{                                                                                                           \
+    if (map->num_buckets)                                                                                   \
+        c_free(a, map->entries, (uint64_t)map->num_buckets * (sizeof(Name##_Entry) + 1));                   \
+    *map = (Name) { 0 };                                                                                    \
+}
+
+#define hash_map_is_used(map, i) \
+    (!((map)->control[i] & HASH_CONTROL_EMPTY))
+
+// Hash and equality functions for common key types
+
+static inline uint64_t hash_map_hash_u64(uint64_t key)
+{
+    return key;
+}
+
+static inline bool hash_map_equal_u64(uint64_t a, uint64_t b)
+{
+    return a == b;
+}
+
+static inline uint64_t hash_map_hash_string8(String8 key)
+{
+    return murmur_hash64a(key.str, key.len, 0);
+}
+
+static inline bool hash_map_equal_string8(String8 a, String8 b)
+{
+    return a.len == b.len && (a.str == b.str || !a.len || memcmp(a.str, b.str, a.len) == 0);
+}
@@ -0,0 +1,503 @@
+#include "job_system.h"
+#include "allocator.h"
+#include "array.h"
+#include "scratch_allocator.h"
+#include "frame_allocator.h"
+#include "os.h"
+#include "log.h"
+#include "atomics.inl"
+
+enum {
+    JOB_QUEUE_CAPACITY = 4096, // Per worker, must be a power of two
+    JOB_NUM_FIBERS = 128,
+    JOB_FIBER_STACK_SIZE = KB(128),
+    JOB_NUM_COUNTERS = 1024,
+    JOB_SPIN_COUNT = 64,
+};
+
+#define NO_FIBER UINT32_MAX
+
+typedef struct Job {
+    job_func *task;
+    void *data;
+    Job_Counter *counter;
+} Job;
+
+struct Job_Counter {
+    AtomicU32 value;
+    uint32_t index;
+    // Signaled when `value` reaches zero, used by waiters that are not running a job
+    Semaphore_Handle done;
+};
+
+// Chase-Lev work-stealing deque. The owning worker pushes and pops at the bottom,
+// other workers steal from the top.
+typedef struct Job_Queue {
+    AtomicU64 top;
+    uint8_t top_padding[56];
+    AtomicU64 bottom;
+    uint8_t bottom_padding[56];
+    Job jobs[JOB_QUEUE_CAPACITY];
+} Job_Queue;
+
+typedef struct Job_Worker {
+    Job_Queue queue;
+    Thread_Handle thread;
+    Fiber_Handle thread_fiber;
+    uint32_t index;
+    // Fiber currently running on this worker
+    uint32_t current_fiber;
+    // Fibers that we switched away from and that can only be released or parked once
+    // their context has been saved, see `private__after_switch()`
+    uint32_t fiber_to_free;
+    uint32_t fiber_to_park;
+    Job_Counter *park_counter;
+    uint64_t random_state;
+} Job_Worker;
+
+typedef struct Waiting_Fiber {
+    uint32_t fiber;
+    Job_Counter *counter;
+} Waiting_Fiber;
+
+static struct Job_System {
+    uint32_t num_workers;
+    Job_Worker *workers;
+
+    Fiber_Handle fibers[JOB_NUM_FIBERS];
+    AtomicU32 fiber_in_use[JOB_NUM_FIBERS];
+
+    Job_Counter counters[JOB_NUM_COUNTERS];
+    AtomicU32 counter_in_use[JOB_NUM_COUNTERS];
+    AtomicU32 next_counter;
+
+    // Fibers parked on a counter
+    Critical_Section waiting_cs;
+    Waiting_Fiber waiting[JOB_NUM_FIBERS];
+    uint32_t num_waiting_locked;
+    AtomicU32 num_waiting;
+
+    // Jobs submitted from threads that are not workers
+    Critical_Section global_cs;
+    Job *global_jobs;
+    uint64_t global_head;
+    AtomicU32 num_global_jobs;
+
+    Semaphore_Handle work_semaphore;
+    AtomicU32 quit;
+} *job_system = 0;
+
+static THREAD_LOCAL Job_Worker *current_worker = 0;
+
+// Fibers may be resumed on another worker thread, so the thread-local must be re-read after every switch
+static NO_INLINE Job_Worker *private__current_worker()
+{
+    return current_worker;
+}
+
+static bool private__queue_push(Job_Queue *q, const Job *job)
+{
+    const uint64_t b = q->bottom;
+    const uint64_t t = atomic_load_64(&q->top);
+    if (b - t >= JOB_QUEUE_CAPACITY)
+    {
+        return false;
+    }
+    q->jobs[b & (JOB_QUEUE_CAPACITY - 1)] = *job;
+    atomic_store_64(&q->bottom, b + 1);
+    return true;
+}
+
+static bool private__queue_pop(Job_Queue *q, Job *job)
+{
+    const uint64_t b = q->bottom - 1;
+    atomic_store_64(&q->bottom, b);
+    atomic_memory_barrier();
+    const uint64_t t = atomic_load_64(&q->top);
+    if ((int64_t)(b - t) < 0)
+    {
+        atomic_store_64(&q->bottom, b + 1);
+        return false;
+    }
+
+    *job = q->jobs[b & (JOB_QUEUE_CAPACITY - 1)];
+    if (b != t)
+    {
+        return true;
+    }
+
+    // Last job, race against thieves for it
+    const bool won = atomic_compare_exchange_64(&q->top, t, t + 1) == t;
+    atomic_store_64(&q->bottom, b + 1);
+    return won;
+}
+
+static bool private__queue_steal(Job_Queue *q, Job *job)
+{
+    const uint64_t t = atomic_load_64(&q->top);
+    atomic_memory_barrier();
+    const uint64_t b = atomic_load_64(&q->bottom);
+    if ((int64_t)(b - t) <= 0)
+    {
+        return false;
+    }
+    *job = q->jobs[t & (JOB_QUEUE_CAPACITY - 1)];
+    return atomic_compare_exchange_64(&q->top, t, t + 1) == t;
+}
+
+static bool private__pop_global_job(Job *job)
+{
+    if (!atomic_load_32(&job_system->num_global_jobs))
+    {
+        return false;
+    }
+
+    bool found = false;
+    os_enter_critical_section(&job_system->global_cs);
+    if (job_system->global_head < array_size(job_system->global_jobs))
+    {
+        *job = job_system->global_jobs[job_system->global_head++];
+        if (job_system->global_head == array_size(job_system->global_jobs))
+        {
+            array_reset(job_system->global_jobs);
+            job_system->global_head = 0;
+        }
+        atomic_fetch_sub_32(&job_system->num_global_jobs, 1);
+        found = true;
+    }
+    os_leave_critical_section(&job_system->global_cs);
+    return found;
+}
+
+static bool private__next_job(Job_Worker *worker, Job *job)
+{
+    if (private__queue_pop(&worker->queue, job))
+    {
+        return true;
+    }
+
+    if (private__pop_global_job(job))
+    {
+        return true;
+    }
+
+    // xorshift64 to pick the first victim
+    uint64_t x = worker->random_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    worker->random_state = x;
+
+    const uint32_t n = job_system->num_workers;
+    const uint32_t first = (uint32_t)(x % n);
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        Job_Worker *victim = &job_system->workers[(first + i) % n];
+        if (victim != worker && private__queue_steal(&victim->queue, job))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint32_t private__acquire_fiber()
+{
+    for (uint32_t i = 0; i < JOB_NUM_FIBERS; ++i)
+    {
+        if (atomic_compare_exchange_32(&job_system->fiber_in_use[i], 0, 1) == 0)
+        {
+            return i;
+        }
+    }
+    log_fatal("Job system ran out of fibers (%u)!", JOB_NUM_FIBERS);
+    return NO_FIBER;
+}
+
+static void private__release_fiber(uint32_t fiber)
+{
+    atomic_store_32(&job_system->fiber_in_use[fiber], 0);
+}
+
+// Pops a parked fiber whose counter has reached zero
+static uint32_t private__pop_ready_fiber()
+{
+    if (!atomic_load_32(&job_system->num_waiting))
+    {
+        return NO_FIBER;
+    }
+
+    uint32_t fiber = NO_FIBER;
+    os_enter_critical_section(&job_system->waiting_cs);
+    for (uint32_t i = 0; i < job_system->num_waiting_locked; ++i)
+    {
+        Waiting_Fiber *w = &job_system->waiting[i];
+        if (atomic_load_32(&w->counter->value) == 0)
+        {
+            fiber = w->fiber;
+            *w = job_system->waiting[--job_system->num_waiting_locked];
+            atomic_fetch_sub_32(&job_system->num_waiting, 1);
+            break;
+        }
+    }
+    os_leave_critical_section(&job_system->waiting_cs);
+    return fiber;
+}
+
+// Runs on the new fiber after every switch, when the previous fiber's context is safely stored
+static void private__after_switch(Job_Worker *worker)
+{
+    if (worker->fiber_to_free != NO_FIBER)
+    {
+        private__release_fiber(worker->fiber_to_free);
+        worker->fiber_to_free = NO_FIBER;
+    }
+
+    if (worker->fiber_to_park != NO_FIBER)
+    {
+        os_enter_critical_section(&job_system->waiting_cs);
+        job_system->waiting[job_system->num_waiting_locked++] = (Waiting_Fiber) {
+            .fiber = worker->fiber_to_park,
+            .counter = worker->park_counter,
+        };
+        atomic_fetch_add_32(&job_system->num_waiting, 1);
+        os_leave_critical_section(&job_system->waiting_cs);
+        worker->fiber_to_park = NO_FIBER;
+        worker->park_counter = 0;
+    }
+}
+
+static void private__switch_to_fiber(Job_Worker *worker, uint32_t fiber)
+{
+    worker->current_fiber = fiber;
+    os_switch_to_fiber(job_system->fibers[fiber]);
+    private__after_switch(private__current_worker());
+}
+
+static void private__decrement_counter(Job_Counter *counter)
+{
+    if (atomic_fetch_sub_32(&counter->value, 1) == 1)
+    {
+        os_semaphore_add(counter->done, 1);
+        if (atomic_load_32(&job_system->num_waiting))
+        {
+            // Wake up a worker to resume the parked fiber
+            os_semaphore_add(job_system->work_semaphore, 1);
+        }
+    }
+}
+
+static void private__fiber_proc(void *user_data)
+{
+    private__after_switch(private__current_worker());
+
+    uint32_t spin = 0;
+    while (true)
+    {
+        Job_Worker *worker = private__current_worker();
+
+        if (atomic_load_32(&job_system->quit))
+        {
+            os_switch_to_fiber(worker->thread_fiber);
+        }
+
+        // Resuming parked fibers first keeps the number of fibers in flight down
+        const uint32_t ready = private__pop_ready_fiber();
+        if (ready != NO_FIBER)
+        {
+            worker->fiber_to_free = worker->current_fiber;
+            private__switch_to_fiber(worker, ready);
+            spin = 0;
+            continue;
+        }
+
+        Job job;
+        if (private__next_job(worker, &job))
+        {
+            job.task(job.data);
+            private__decrement_counter(job.counter);
+            spin = 0;
+            continue;
+        }
+
+        if (++spin < JOB_SPIN_COUNT)
+        {
+            os_yield_processor();
+        }
+        else
+        {
+            os_semaphore_wait(job_system->work_semaphore);
+            spin = 0;
+        }
+    }
+}
+
+static void private__worker_entry_point(void *user_data)
+{
+    Job_Worker *worker = (Job_Worker *)user_data;
+    current_worker = worker;
+    worker->thread_fiber = os_convert_thread_to_fiber(worker);
+
+    // Only returns once the job system is shutting down
+    private__switch_to_fiber(worker, private__acquire_fiber());
+
+    os_convert_fiber_to_thread();
+    scratch_release_thread();
+    frame_allocator_release_thread();
+}
+
+void job_system_init(uint32_t num_workers)
+{
+    check(!job_system);
+
+    job_system = c_alloc(system_allocator, sizeof(*job_system));
+    memset(job_system, 0, sizeof(*job_system));
+
+    job_system->num_workers = num_workers ? num_workers : os_num_logical_processors();
+    job_system->work_semaphore = os_create_semaphore(0);
+    os_create_critical_section(&job_system->waiting_cs);
+    os_create_critical_section(&job_system->global_cs);
+
+    for (uint32_t i = 0; i < JOB_NUM_COUNTERS; ++i)
+    {
+        job_system->counters[i].index = i;
+        job_system->counters[i].done = os_create_semaphore(0);
+    }
+
+    for (uint32_t i = 0; i < JOB_NUM_FIBERS; ++i)
+    {
+        job_system->fibers[i] = os_create_fiber(private__fiber_proc, 0, JOB_FIBER_STACK_SIZE);
+    }
+
+    const uint64_t workers_size = job_system->num_workers * sizeof(Job_Worker);
+    job_system->workers = c_alloc(system_allocator, workers_size);
+    memset(job_system->workers, 0, workers_size);
+
+    for (uint32_t i = 0; i < job_system->num_workers; ++i)
+    {
+        Job_Worker *worker = &job_system->workers[i];
+        worker->index = i;
+        worker->current_fiber = NO_FIBER;
+        worker->fiber_to_free = NO_FIBER;
+        worker->fiber_to_park = NO_FIBER;
+        worker->random_state = 0x9e3779b97f4a7c15ULL * (i + 1);
+    }
+
+    for (uint32_t i = 0; i < job_system->num_workers; ++i)
+    {
+        job_system->workers[i].thread = os_create_thread(private__worker_entry_point, &job_system->workers[i], MB(1));
+    }
+}
+
+void job_system_shutdown()
+{
+    check(job_system);
+
+    atomic_store_32(&job_system->quit, 1);
+    os_semaphore_add(job_system->work_semaphore, job_system->num_workers);
+
+    for (uint32_t i = 0; i < job_system->num_workers; ++i)
+    {
+        os_wait_for_thread(job_system->workers[i].thread);
+    }
+
+    for (uint32_t i = 0; i < JOB_NUM_FIBERS; ++i)
+    {
+        os_destroy_fiber(job_system->fibers[i]);
+    }
+
+    for (uint32_t i = 0; i < JOB_NUM_COUNTERS; ++i)
+    {
+        os_destroy_semaphore(job_system->counters[i].done);
+    }
+
+    os_destroy_semaphore(job_system->work_semaphore);
+    array_free(job_system->global_jobs, system_allocator);
+    c_free(system_allocator, job_system->workers, job_system->num_workers * sizeof(Job_Worker));
+    c_free(system_allocator, job_system, sizeof(*job_system));
+    job_system = 0;
+}
+
+static Job_Counter *private__acquire_counter(uint32_t value)
+{
+    for (uint32_t attempt = 0; attempt < JOB_NUM_COUNTERS; ++attempt)
+    {
+        const uint32_t i = atomic_fetch_add_32(&job_system->next_counter, 1) % JOB_NUM_COUNTERS;
+        if (atomic_compare_exchange_32(&job_system->counter_in_use[i], 0, 1) == 0)
+        {
+            Job_Counter *counter = &job_system->counters[i];
+            // Drain the signal left over from the previous use
+            while (os_semaphore_poll(counter->done));
+            atomic_store_32(&counter->value, value);
+            return counter;
+        }
+    }
+    log_fatal("Job system ran out of counters (%u)!", JOB_NUM_COUNTERS);
+    return 0;
+}
+
+Job_Counter *run_jobs(const Job_Decl *jobs, uint32_t num_jobs)
+{
+    Job_Counter *counter = private__acquire_counter(num_jobs);
+
+    Job_Worker *worker = private__current_worker();
+    for (uint32_t i = 0; i < num_jobs; ++i)
+    {
+        const Job job = {
+            .task = jobs[i].task,
+            .data = jobs[i].data,
+            .counter = counter,
+        };
+        if (!worker || !private__queue_push(&worker->queue, &job))
+        {
+            os_enter_critical_section(&job_system->global_cs);
+            array_push(job_system->global_jobs, job, system_allocator);
+            atomic_fetch_add_32(&job_system->num_global_jobs, 1);
+            os_leave_critical_section(&job_system->global_cs);
+        }
+    }
+
+    if (num_jobs)
+    {
+        os_semaphore_add(job_system->work_semaphore, c_min(num_jobs, job_system->num_workers));
+    }
+
+    return counter;
+}
+
+void wait_for_counter_and_free(Job_Counter *counter)
+{
+    if (atomic_load_32(&counter->value) != 0)
+    {
+        Job_Worker *worker = private__current_worker();
+        if (worker)
+        {
+            // Park this fiber and keep the worker busy with a fresh one
+            worker->fiber_to_park = worker->current_fiber;
+            worker->park_counter = counter;
+            private__switch_to_fiber(worker, private__acquire_fiber());
+        }
+        else
+        {
+            // The counter may carry a late signal from its previous batch, posted after that batch's
+            // waiter had already seen zero and freed the counter, so wait until the value says done
+            while (atomic_load_32(&counter->value) != 0)
+            {
+                os_semaphore_wait(counter->done);
+            }
+        }
+    }
+
+    atomic_store_32(&job_system->counter_in_use[counter->index], 0);
+}
+
+uint32_t job_worker_index()
+{
+    Job_Worker *worker = private__current_worker();
+    return worker ? worker->index : UINT32_MAX;
+}
+
+uint32_t job_num_workers()
+{
+    return job_system ? job_system->num_workers : 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include "basic.h"
+
+typedef void job_func(void *data);
+
+typedef struct Job_Decl {
+    job_func *task;
+    void *data;
+} Job_Decl;
+
+// Counter that reaches zero when all jobs of a `run_jobs()` batch have completed
+typedef struct Job_Counter Job_Counter;
+
+// Starts `num_workers` worker threads, or one per logical processor if `num_workers` is 0
+void job_system_init(uint32_t num_workers);
+
+// Stops and joins all worker threads. Jobs still in flight are abandoned.
+void job_system_shutdown();
+
+// Schedules `num_jobs` jobs and returns a counter that tracks their completion
+Job_Counter *run_jobs(const Job_Decl *jobs, uint32_t num_jobs);
+
+// Waits until `counter` reaches zero and returns it to the counter pool.
+// Inside a job the fiber is yielded so the worker can run other jobs meanwhile,
+// on any other thread the calling thread blocks.
+void wait_for_counter_and_free(Job_Counter *counter);
+
+// Index of the worker running the calling job, or `UINT32_MAX` outside of the job system
+uint32_t job_worker_index();
+
+// Number of worker threads
+uint32_t job_num_workers();
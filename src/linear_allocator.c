@@ -1,28 +1,76 @@
 #include "linear_allocator.h"
 #include "allocator.h"
+#include "os.h"
 #include "log.h"
+#include <string.h>
+
+enum {
+    // Pages are committed in chunks of this size when the allocator uses virtual memory
+    LINEAR_COMMIT_SIZE = KB(64),
+};
 
 typedef struct Linear_Allocator_Data {
     uint8_t *p;
     uint64_t offset;
     uint64_t total_size;
+    // Start of the most recent allocation, which can be resized or freed in place
+    uint64_t last_offset;
+    // Bytes committed after `p`, only used in virtual memory mode
+    uint64_t committed;
+    // 0 in virtual memory mode
     Allocator *backing;
 } Linear_Allocator_Data;
 
-static void *linear_alloc(Allocator *allocator, void *old_ptr, uint64_t old_size, uint64_t new_size, 
-        const char *file, uint32_t line)
+typedef struct Linear_Allocator_VM {
+    Allocator allocator;
+    Linear_Allocator_Data data;
+} Linear_Allocator_VM;
+
+static void linear__ensure_committed(Linear_Allocator_Data *data, uint64_t end)
+{
+    if (data->backing || end <= data->committed)
+    {
+        return;
+    }
+
+    const uint64_t committed = c_min(ALIGN_SIZE(end, LINEAR_COMMIT_SIZE), data->total_size);
+    os_commit(data->p + data->committed, committed - data->committed);
+    data->committed = committed;
+}
+
+static void *linear_alloc(Allocator *allocator, void *old_ptr, uint64_t old_size, uint64_t new_size,
+        uint32_t align, const char *file, uint32_t line)
 {
     Linear_Allocator_Data *data = allocator->user_data;
 
+    // The most recent allocation grows, shrinks and frees in place
+    const bool is_last = old_ptr && (uint8_t *)old_ptr == data->p + data->last_offset
+        && data->last_offset + old_size == data->offset;
+    if (is_last)
+    {
+        fatal_checkf(data->last_offset + new_size <= data->total_size, "Linear allocator exhausted!");
+        linear__ensure_committed(data, data->last_offset + new_size);
+        data->offset = data->last_offset + new_size;
+        return new_size ? old_ptr : 0;
+    }
+
     void *result = 0;
     if (new_size != 0)
     {
-        fatal_checkf("Linear allocator exhausted!\
-            Attempted to allocated %zu bytes which would exceed the maximum of %zu bytes",
-            new_size, data->total_size);
-        
-        result = data->p + data->offset;
-        data->offset += new_size;
+        align = align ? align : ALLOCATOR_DEFAULT_ALIGN;
+        const uint64_t address = (uint64_t)(uintptr_t)(data->p + data->offset);
+        const uint64_t offset = data->offset + (ALIGN_SIZE(address, align) - address);
+        fatal_checkf(offset + new_size <= data->total_size, "Linear allocator exhausted!");
+        linear__ensure_committed(data, offset + new_size);
+
+        result = data->p + offset;
+        data->last_offset = offset;
+        data->offset = offset + new_size;
+
+        if (old_ptr)
+        {
+            memcpy(result, old_ptr, c_min(old_size, new_size));
+        }
     }
     return result;
 }
@@ -38,28 +86,77 @@ Allocator *linear_allocator_create(uint64_t total_size, Allocator *backing)
     };
 
     Linear_Allocator_Data *data = a->user_data;
-    data->p = c_alloc(backing, total_size);
-    data->offset = 0;
-    data->total_size = total_size;
-    data->backing = backing;
+    *data = (Linear_Allocator_Data) {
+        .p = c_alloc(backing, total_size),
+        .total_size = total_size,
+        .backing = backing,
+    };
 
     return a;
 }
 
+Allocator *linear_allocator_create_vm(uint64_t reserve_size)
+{
+    check(reserve_size != 0);
+
+    // The allocator lives in the first page of the reservation
+    reserve_size = ALIGN_SIZE(reserve_size, PAGE_SIZE) + PAGE_SIZE;
+    uint8_t *base = os_reserve(reserve_size);
+    os_commit(base, PAGE_SIZE);
+
+    Linear_Allocator_VM *vm = (Linear_Allocator_VM *)base;
+    vm->allocator = (Allocator) {
+        .allocate_func = linear_alloc,
+        .user_data = &vm->data,
+    };
+    vm->data = (Linear_Allocator_Data) {
+        .p = base + PAGE_SIZE,
+        .total_size = reserve_size - PAGE_SIZE,
+    };
+
+    return &vm->allocator;
+}
+
 void linear_allocator_destroy(Allocator *a)
 {
     Linear_Allocator_Data *data = a->user_data;
     check(data && data->total_size != 0);
 
     Allocator *backing = data->backing;
+    if (!backing)
+    {
+        os_release(a);
+        return;
+    }
+
     c_free(backing, data->p, data->total_size);
     c_free(backing, data, sizeof(*data));
     c_free(backing, a, sizeof(*a));
 }
 
 void rewind_linear_allocator(struct Allocator *a)
+{
+    rewind_linear_allocator_to(a, (Linear_Allocator_Marker) { 0 });
+}
+
+Linear_Allocator_Marker linear_allocator_marker(struct Allocator *a)
 {
     Linear_Allocator_Data *data = a->user_data;
     check(data && data->total_size != 0);
-    data->offset = 0;
-}
\ No newline at end of file
+    return (Linear_Allocator_Marker) { data->offset };
+}
+
+void rewind_linear_allocator_to(struct Allocator *a, Linear_Allocator_Marker marker)
+{
+    Linear_Allocator_Data *data = a->user_data;
+    check(data && data->total_size != 0);
+    check(marker.offset <= data->offset);
+    data->offset = marker.offset;
+    data->last_offset = marker.offset;
+}
+
+uint64_t linear_allocator_committed(struct Allocator *a)
+{
+    Linear_Allocator_Data *data = a->user_data;
+    return data->backing ? data->total_size : data->committed;
+}
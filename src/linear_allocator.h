@@ -3,8 +3,26 @@
 
 struct Allocator;
 
+typedef struct Linear_Allocator_Marker {
+    uint64_t offset;
+} Linear_Allocator_Marker;
+
+// Creates a linear allocator with a fixed `total_size` bytes allocated from `backing`.
+// Reallocating or freeing the most recent allocation happens in place, other frees are ignored.
 struct Allocator *linear_allocator_create(uint64_t total_size, struct Allocator *backing);
 
+// Creates a linear allocator that reserves `reserve_size` bytes of virtual memory and commits
+// it as the allocator fills up. Committed pages are kept when the allocator is rewound.
+struct Allocator *linear_allocator_create_vm(uint64_t reserve_size);
+
 void linear_allocator_destroy(struct Allocator *a);
 
 void rewind_linear_allocator(struct Allocator *a);
+
+// Returns the current position, rewind to it to free everything allocated after it
+Linear_Allocator_Marker linear_allocator_marker(struct Allocator *a);
+
+void rewind_linear_allocator_to(struct Allocator *a, Linear_Allocator_Marker marker);
+
+// Bytes of memory backing the allocator
+uint64_t linear_allocator_committed(struct Allocator *a);
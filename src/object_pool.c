@@ -0,0 +1,463 @@
+#include "object_pool.h"
+#include "allocator.h"
+#include "os.h"
+#include "log.h"
+#include "atomics.inl"
+#include <string.h>
+
+enum {
+    // Fresh objects are carved out of the reservation in chunks of at least this size
+    OBJECT_POOL_MIN_CHUNK_SIZE = KB(64),
+    // Heads of the shared stacks keep a pointer in the low bits and a counter in the high bits,
+    // so a head that was popped and pushed back between a load and a compare-exchange is detected
+    OBJECT_POOL_TAG_SHIFT = 48,
+};
+
+static const uint64_t object_pool_pointer_mask = (1ULL << OBJECT_POOL_TAG_SHIFT) - 1;
+
+typedef struct Magazine {
+    // Link in a shared stack, read by threads racing to pop the magazine
+    AtomicU64 next;
+    // Link in the list of all magazines of the pool
+    struct Magazine *next_allocated;
+    uint32_t count;
+    void *objects[OBJECT_POOL_MAGAZINE_SIZE];
+} Magazine;
+
+// Per-thread cache, only accessed by the owning thread. Frees go to `loaded` and allocations
+// come from it, `previous` absorbs a thread alternating around a magazine boundary.
+typedef struct Object_Pool_Thread {
+    Magazine *loaded;
+    Magazine *previous;
+    struct Object_Pool_Thread *next;
+} Object_Pool_Thread;
+
+typedef struct Object_Pool {
+    uint32_t id;
+    // Unique per pool, tells a thread's cache of a destroyed pool apart from the pool reusing its id
+    uint64_t serial;
+    uint32_t object_size;
+    uint32_t stride;
+    uint8_t *base;
+    uint64_t chunk_size;
+    uint64_t objects_per_chunk;
+    uint64_t num_chunks;
+    AtomicU64 next_chunk;
+    // Tagged stacks of magazines with free objects and of empty magazines
+    AtomicU64 full_magazines;
+    AtomicU64 empty_magazines;
+    AtomicU64 num_full_magazines;
+    AtomicU64 all_magazines;
+    AtomicU64 threads;
+    Allocator *backing;
+} Object_Pool;
+
+typedef struct Object_Pool_Thread_Slot {
+    uint64_t serial;
+    Object_Pool_Thread *t;
+} Object_Pool_Thread_Slot;
+
+static AtomicU64 object_pool_ids = 0;
+static AtomicU64 object_pool_serial = 0;
+static THREAD_LOCAL Object_Pool_Thread_Slot object_pool_threads[MAX_OBJECT_POOLS];
+
+STATIC_ASSERT(MAX_OBJECT_POOLS <= 64);
+
+static inline Magazine *private__stack_pointer(uint64_t head)
+{
+    return (Magazine *)(uintptr_t)(head & object_pool_pointer_mask);
+}
+
+static inline uint64_t private__stack_head(uint64_t prev_head, Magazine *m)
+{
+    const uint64_t tag = (prev_head >> OBJECT_POOL_TAG_SHIFT) + 1;
+    return (uint64_t)(uintptr_t)m | (tag << OBJECT_POOL_TAG_SHIFT);
+}
+
+static void private__push(AtomicU64 *stack, Magazine *m)
+{
+    uint64_t head = atomic_load_64(stack);
+    while (true)
+    {
+        atomic_store_64(&m->next, (uint64_t)(uintptr_t)private__stack_pointer(head));
+        const uint64_t prev = atomic_compare_exchange_64(stack, head, private__stack_head(head, m));
+        if (prev == head)
+        {
+            return;
+        }
+        head = prev;
+    }
+}
+
+// Magazines are only freed when the pool is destroyed, so reading `next` of a magazine another
+// thread popped in the meantime is safe, the tag makes the compare-exchange fail
+static Magazine *private__pop(AtomicU64 *stack)
+{
+    uint64_t head = atomic_load_64(stack);
+    while (true)
+    {
+        Magazine *m = private__stack_pointer(head);
+        if (!m)
+        {
+            return 0;
+        }
+        Magazine *next = (Magazine *)(uintptr_t)atomic_load_64(&m->next);
+        const uint64_t prev = atomic_compare_exchange_64(stack, head, private__stack_head(head, next));
+        if (prev == head)
+        {
+            return m;
+        }
+        head = prev;
+    }
+}
+
+static void private__push_full(Object_Pool *pool, Magazine *m)
+{
+    atomic_fetch_add_64(&pool->num_full_magazines, 1);
+    private__push(&pool->full_magazines, m);
+}
+
+static Magazine *private__pop_full(Object_Pool *pool)
+{
+    Magazine *m = private__pop(&pool->full_magazines);
+    if (m)
+    {
+        atomic_fetch_sub_64(&pool->num_full_magazines, 1);
+    }
+    return m;
+}
+
+static Magazine *private__empty_magazine(Object_Pool *pool)
+{
+    Magazine *m = private__pop(&pool->empty_magazines);
+    if (m)
+    {
+        return m;
+    }
+
+    m = c_alloc(pool->backing, sizeof(*m));
+    fatal_checkf(((uint64_t)(uintptr_t)m & ~object_pool_pointer_mask) == 0, "Magazine address doesn't fit a tagged pointer!");
+    m->count = 0;
+    atomic_store_64(&m->next, 0);
+
+    uint64_t head = atomic_load_64(&pool->all_magazines);
+    while (true)
+    {
+        m->next_allocated = (Magazine *)(uintptr_t)head;
+        const uint64_t prev = atomic_compare_exchange_64(&pool->all_magazines, head, (uint64_t)(uintptr_t)m);
+        if (prev == head)
+        {
+            return m;
+        }
+        head = prev;
+    }
+}
+
+// Commits the next unused chunk and returns a magazine with some of its objects, the rest are
+// shared with other threads. Returns 0 if the reservation is used up.
+static Magazine *private__carve_chunk(Object_Pool *pool)
+{
+    const uint64_t index = atomic_fetch_add_64(&pool->next_chunk, 1);
+    if (index >= pool->num_chunks)
+    {
+        return 0;
+    }
+
+    uint8_t *chunk = pool->base + index * pool->chunk_size;
+    os_commit(chunk, pool->chunk_size);
+
+    Magazine *result = 0;
+    for (uint64_t i = 0; i < pool->objects_per_chunk; )
+    {
+        Magazine *m = private__empty_magazine(pool);
+        const uint32_t n = (uint32_t)c_min(OBJECT_POOL_MAGAZINE_SIZE, pool->objects_per_chunk - i);
+        // Reversed so that objects are handed out in address order
+        for (uint32_t j = 0; j < n; ++j)
+        {
+            m->objects[j] = chunk + (i + n - 1 - j) * pool->stride;
+        }
+        m->count = n;
+        i += n;
+
+        if (!result)
+        {
+            result = m;
+        }
+        else
+        {
+            private__push_full(pool, m);
+        }
+    }
+    return result;
+}
+
+static Object_Pool_Thread *private__thread(Object_Pool *pool)
+{
+    Object_Pool_Thread_Slot *slot = &object_pool_threads[pool->id];
+    if (slot->serial == pool->serial)
+    {
+        return slot->t;
+    }
+
+    Object_Pool_Thread *t = c_alloc(pool->backing, sizeof(*t));
+    memset(t, 0, sizeof(*t));
+    uint64_t head = atomic_load_64(&pool->threads);
+    while (true)
+    {
+        t->next = (Object_Pool_Thread *)(uintptr_t)head;
+        const uint64_t prev = atomic_compare_exchange_64(&pool->threads, head, (uint64_t)(uintptr_t)t);
+        if (prev == head)
+        {
+            break;
+        }
+        head = prev;
+    }
+    *slot = (Object_Pool_Thread_Slot) { .serial = pool->serial, .t = t };
+    return t;
+}
+
+static void *private__alloc_object(Object_Pool *pool)
+{
+    Object_Pool_Thread *t = private__thread(pool);
+    if (!t->loaded || !t->loaded->count)
+    {
+        if (t->previous && t->previous->count)
+        {
+            Magazine *m = t->loaded;
+            t->loaded = t->previous;
+            t->previous = m;
+        }
+        else
+        {
+            Magazine *full = private__pop_full(pool);
+            if (!full)
+            {
+                full = private__carve_chunk(pool);
+            }
+            if (!full)
+            {
+                return 0;
+            }
+            // Keep the empty magazine around for frees
+            if (t->previous)
+            {
+                private__push(&pool->empty_magazines, t->previous);
+            }
+            t->previous = t->loaded;
+            t->loaded = full;
+        }
+    }
+    return t->loaded->objects[--t->loaded->count];
+}
+
+static void private__free_object(Object_Pool *pool, void *p)
+{
+    Object_Pool_Thread *t = private__thread(pool);
+    if (!t->loaded || t->loaded->count == OBJECT_POOL_MAGAZINE_SIZE)
+    {
+        if (t->previous && t->previous->count < OBJECT_POOL_MAGAZINE_SIZE)
+        {
+            Magazine *m = t->loaded;
+            t->loaded = t->previous;
+            t->previous = m;
+        }
+        else
+        {
+            if (t->previous)
+            {
+                private__push_full(pool, t->previous);
+            }
+            t->previous = t->loaded;
+            t->loaded = private__empty_magazine(pool);
+        }
+    }
+    t->loaded->objects[t->loaded->count++] = p;
+}
+
+static inline bool private__owns(const Object_Pool *pool, const void *p)
+{
+    const uint8_t *q = p;
+    return q >= pool->base && q < pool->base + pool->num_chunks * pool->chunk_size;
+}
+
+// Chunks are page aligned, so objects are aligned to any power of two their stride is a multiple of
+static inline bool private__fits(const Object_Pool *pool, uint64_t size, uint32_t align)
+{
+    const bool aligned = align <= ALLOCATOR_DEFAULT_ALIGN || (align <= PAGE_SIZE && pool->stride % align == 0);
+    return size && size <= pool->object_size && aligned;
+}
+
+static void *object_pool_alloc(Allocator *allocator, void *old_ptr, uint64_t old_size, uint64_t new_size,
+        uint32_t align, const char *file, uint32_t line)
+{
+    Object_Pool *pool = allocator->user_data;
+    Allocator *backing = pool->backing;
+    const bool old_pooled = old_ptr && private__owns(pool, old_ptr);
+    const bool new_fits = private__fits(pool, new_size, align);
+
+    if (old_ptr && !old_pooled && new_size && !new_fits)
+    {
+        return backing->allocate_func(backing, old_ptr, old_size, new_size, align, file, line);
+    }
+
+    if (old_pooled && new_fits)
+    {
+        record_deallocation(allocator, old_ptr, old_size);
+        record_allocation(allocator, old_ptr, new_size, file, line);
+        return old_ptr;
+    }
+
+    void *new_ptr = 0;
+    if (new_fits)
+    {
+        new_ptr = private__alloc_object(pool);
+        if (new_ptr)
+        {
+            record_allocation(allocator, new_ptr, new_size, file, line);
+        }
+    }
+    if (new_size && !new_ptr)
+    {
+        new_ptr = backing->allocate_func(backing, 0, 0, new_size, align, file, line);
+    }
+
+    if (old_ptr && new_ptr)
+    {
+        memcpy(new_ptr, old_ptr, c_min(old_size, new_size));
+    }
+
+    if (old_pooled)
+    {
+        record_deallocation(allocator, old_ptr, old_size);
+        private__free_object(pool, old_ptr);
+    }
+    else if (old_ptr)
+    {
+        backing->allocate_func(backing, old_ptr, old_size, 0, align, file, line);
+    }
+
+    return new_ptr;
+}
+
+Allocator *object_pool_create(uint32_t object_size, uint64_t max_objects, Allocator *backing)
+{
+    check(object_size != 0 && max_objects != 0);
+
+    uint32_t id = MAX_OBJECT_POOLS;
+    uint64_t ids = atomic_load_64(&object_pool_ids);
+    while (ids != ~0ULL)
+    {
+        uint32_t free_id = 0;
+        while (ids & (1ULL << free_id))
+        {
+            ++free_id;
+        }
+        const uint64_t prev = atomic_compare_exchange_64(&object_pool_ids, ids, ids | (1ULL << free_id));
+        if (prev == ids)
+        {
+            id = free_id;
+            break;
+        }
+        ids = prev;
+    }
+    fatal_checkf(id < MAX_OBJECT_POOLS, "Too many object pools created!");
+
+    Allocator *a = c_alloc(backing, sizeof(*a));
+    *a = (Allocator) {
+        .allocate_func = object_pool_alloc,
+        .user_data = c_alloc(backing, sizeof(Object_Pool)),
+    };
+
+    Object_Pool *pool = a->user_data;
+    memset(pool, 0, sizeof(*pool));
+    pool->id = id;
+    pool->serial = atomic_fetch_add_64(&object_pool_serial, 1) + 1;
+    pool->object_size = object_size;
+    pool->stride = (uint32_t)ALIGN_SIZE((uint64_t)object_size, ALLOCATOR_DEFAULT_ALIGN);
+    pool->chunk_size = ALIGN_SIZE(c_max(OBJECT_POOL_MIN_CHUNK_SIZE, (uint64_t)pool->stride * OBJECT_POOL_MAGAZINE_SIZE), PAGE_SIZE);
+    pool->objects_per_chunk = pool->chunk_size / pool->stride;
+    pool->num_chunks = (max_objects + pool->objects_per_chunk - 1) / pool->objects_per_chunk;
+    pool->base = os_reserve(pool->num_chunks * pool->chunk_size);
+    pool->backing = backing;
+
+    return a;
+}
+
+void object_pool_destroy(Allocator *a)
+{
+    Object_Pool *pool = a->user_data;
+    Allocator *backing = pool->backing;
+
+    Object_Pool_Thread *t = (Object_Pool_Thread *)(uintptr_t)atomic_load_64(&pool->threads);
+    while (t)
+    {
+        Object_Pool_Thread *next = t->next;
+        c_free(backing, t, sizeof(*t));
+        t = next;
+    }
+
+    Magazine *m = (Magazine *)(uintptr_t)atomic_load_64(&pool->all_magazines);
+    while (m)
+    {
+        Magazine *next = m->next_allocated;
+        c_free(backing, m, sizeof(*m));
+        m = next;
+    }
+
+    os_release(pool->base);
+
+    uint64_t ids = atomic_load_64(&object_pool_ids);
+    while (true)
+    {
+        const uint64_t prev = atomic_compare_exchange_64(&object_pool_ids, ids, ids & ~(1ULL << pool->id));
+        if (prev == ids)
+        {
+            break;
+        }
+        ids = prev;
+    }
+
+    c_free(backing, pool, sizeof(*pool));
+    c_free(backing, a, sizeof(*a));
+}
+
+void object_pool_release_thread(Allocator *a)
+{
+    Object_Pool *pool = a->user_data;
+    Object_Pool_Thread_Slot *slot = &object_pool_threads[pool->id];
+    if (slot->serial != pool->serial)
+    {
+        return;
+    }
+
+    // Partially filled magazines are shared like full ones
+    Object_Pool_Thread *t = slot->t;
+    Magazine *magazines[] = { t->loaded, t->previous };
+    for (uint32_t i = 0; i < ARRAY_COUNT(magazines); ++i)
+    {
+        Magazine *m = magazines[i];
+        if (m && m->count)
+        {
+            private__push_full(pool, m);
+        }
+        else if (m)
+        {
+            private__push(&pool->empty_magazines, m);
+        }
+    }
+    t->loaded = 0;
+    t->previous = 0;
+}
+
+Object_Pool_Stats object_pool_stats(Allocator *a)
+{
+    Object_Pool *pool = a->user_data;
+    const uint64_t num_chunks = c_min(atomic_load_64(&pool->next_chunk), pool->num_chunks);
+    return (Object_Pool_Stats) {
+        .object_size = pool->object_size,
+        .num_objects = num_chunks * pool->objects_per_chunk,
+        .max_objects = pool->num_chunks * pool->objects_per_chunk,
+        .committed = num_chunks * pool->chunk_size,
+        .num_shared_magazines = atomic_load_64(&pool->num_full_magazines),
+    };
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include "basic.h"
+
+struct Allocator;
+
+enum {
+    // Objects move between threads and the shared stacks in magazines of this many objects
+    OBJECT_POOL_MAGAZINE_SIZE = 64,
+    MAX_OBJECT_POOLS = 64,
+};
+
+typedef struct Object_Pool_Stats {
+    uint32_t object_size;
+    // Objects carved out of the reservation so far, free or not
+    uint64_t num_objects;
+    uint64_t max_objects;
+    uint64_t committed;
+    // Magazines of free objects on the shared stack, available to any thread
+    uint64_t num_shared_magazines;
+} Object_Pool_Stats;
+
+// Creates a pool of fixed-size objects that reserves virtual memory for `max_objects` objects of
+// `object_size` bytes. Every thread allocates and frees through its own magazines without locking,
+// full and empty magazines are exchanged through lock-free shared stacks, so objects freed on one
+// thread are reused by others. Larger sizes, unsupported alignments and allocations made once the
+// pool is exhausted go to `backing`, which also holds the pool's bookkeeping.
+struct Allocator *object_pool_create(uint32_t object_size, uint64_t max_objects, struct Allocator *backing);
+
+#define object_pool_create_typed(T, max_objects, backing) object_pool_create(sizeof(T), max_objects, backing)
+
+// All threads must be done with the pool
+void object_pool_destroy(struct Allocator *a);
+
+// Hands the calling thread's cached objects back to the pool, call before a thread that used the
+// pool exits
+void object_pool_release_thread(struct Allocator *a);
+
+Object_Pool_Stats object_pool_stats(struct Allocator *a);
@@ -0,0 +1,430 @@
+#include "offset_allocator.h"
+#include "allocator.h"
+#include "array.h"
+#include "log.h"
+#include <string.h>
+
+// Bin sizes are small floats with a 3 bit mantissa, 8 leaf bins per power of two
+enum {
+    OA_MANTISSA_BITS = 3,
+    OA_MANTISSA_VALUE = 1 << OA_MANTISSA_BITS,
+    OA_MANTISSA_MASK = OA_MANTISSA_VALUE - 1,
+    OA_NUM_TOP_BINS = 32,
+    OA_BINS_PER_LEAF = 8,
+    OA_TOP_BINS_INDEX_SHIFT = 3,
+    OA_LEAF_BINS_INDEX_MASK = 0x7,
+    OA_NUM_LEAF_BINS = OA_NUM_TOP_BINS * OA_BINS_PER_LEAF,
+};
+
+#define OA_UNUSED 0xffffffffu
+
+typedef struct Offset_Allocator_Node {
+    uint32_t offset;
+    uint32_t size;
+    // Free nodes are linked in their bin
+    uint32_t bin_prev;
+    uint32_t bin_next;
+    // Neighbours in address order, free and used
+    uint32_t neighbor_prev;
+    uint32_t neighbor_next;
+    bool used;
+} Offset_Allocator_Node;
+
+struct Offset_Allocator {
+    uint32_t size;
+    uint32_t max_allocations;
+    uint32_t max_nodes;
+    uint32_t num_allocations;
+    uint32_t num_free_regions;
+    uint32_t free_storage;
+
+    uint32_t used_bins_top;
+    uint8_t used_bins[OA_NUM_TOP_BINS];
+    uint32_t bin_heads[OA_NUM_LEAF_BINS];
+
+    Offset_Allocator_Node *nodes;
+    // Stack of unused node indices
+    uint32_t *free_nodes;
+    uint32_t num_free_nodes;
+
+    struct Allocator *allocator;
+};
+
+static inline uint32_t private__lowest_bit_after(uint32_t mask, uint32_t start)
+{
+    const uint32_t bits = start < 32 ? mask & ~((1u << start) - 1) : 0;
+    return bits ? c_lowest_bit32(bits) : OA_UNUSED;
+}
+
+// Bin that every size in it fits, used for allocating
+static uint32_t private__bin_round_up(uint32_t size)
+{
+    if (size < OA_MANTISSA_VALUE)
+    {
+        return size;
+    }
+
+    const uint32_t mantissa_start = c_highest_bit32(size) - OA_MANTISSA_BITS;
+    const uint32_t exp = mantissa_start + 1;
+    uint32_t mantissa = (size >> mantissa_start) & OA_MANTISSA_MASK;
+    if (size & ((1u << mantissa_start) - 1))
+    {
+        ++mantissa;
+    }
+    // A mantissa overflow carries into the exponent
+    return (exp << OA_MANTISSA_BITS) + mantissa;
+}
+
+// Bin that `size` is stored in, used for free regions
+static uint32_t private__bin_round_down(uint32_t size)
+{
+    if (size < OA_MANTISSA_VALUE)
+    {
+        return size;
+    }
+
+    const uint32_t mantissa_start = c_highest_bit32(size) - OA_MANTISSA_BITS;
+    const uint32_t exp = mantissa_start + 1;
+    const uint32_t mantissa = (size >> mantissa_start) & OA_MANTISSA_MASK;
+    return (exp << OA_MANTISSA_BITS) | mantissa;
+}
+
+static uint32_t private__insert_free_node(Offset_Allocator *oa, uint32_t offset, uint32_t size)
+{
+    const uint32_t bin = private__bin_round_down(size);
+    const uint32_t top = bin >> OA_TOP_BINS_INDEX_SHIFT;
+    const uint32_t leaf = bin & OA_LEAF_BINS_INDEX_MASK;
+
+    if (oa->bin_heads[bin] == OA_UNUSED)
+    {
+        oa->used_bins[top] |= 1 << leaf;
+        oa->used_bins_top |= 1u << top;
+    }
+
+    const uint32_t head = oa->bin_heads[bin];
+    const uint32_t index = oa->free_nodes[--oa->num_free_nodes];
+    oa->nodes[index] = (Offset_Allocator_Node) {
+        .offset = offset,
+        .size = size,
+        .bin_prev = OA_UNUSED,
+        .bin_next = head,
+        .neighbor_prev = OA_UNUSED,
+        .neighbor_next = OA_UNUSED,
+    };
+    if (head != OA_UNUSED)
+    {
+        oa->nodes[head].bin_prev = index;
+    }
+    oa->bin_heads[bin] = index;
+
+    oa->free_storage += size;
+    ++oa->num_free_regions;
+    return index;
+}
+
+// Unlinks free node `index` from its bin, the node itself stays allocated
+static void private__unlink_free_node(Offset_Allocator *oa, uint32_t index)
+{
+    Offset_Allocator_Node *node = oa->nodes + index;
+    if (node->bin_prev != OA_UNUSED)
+    {
+        oa->nodes[node->bin_prev].bin_next = node->bin_next;
+    }
+    else
+    {
+        const uint32_t bin = private__bin_round_down(node->size);
+        const uint32_t top = bin >> OA_TOP_BINS_INDEX_SHIFT;
+        const uint32_t leaf = bin & OA_LEAF_BINS_INDEX_MASK;
+        oa->bin_heads[bin] = node->bin_next;
+        if (node->bin_next == OA_UNUSED)
+        {
+            oa->used_bins[top] &= ~(1 << leaf);
+            if (!oa->used_bins[top])
+            {
+                oa->used_bins_top &= ~(1u << top);
+            }
+        }
+    }
+    if (node->bin_next != OA_UNUSED)
+    {
+        oa->nodes[node->bin_next].bin_prev = node->bin_prev;
+    }
+
+    oa->free_storage -= node->size;
+    --oa->num_free_regions;
+}
+
+// Released nodes have a size of 0, live nodes never do
+static void private__release_node(Offset_Allocator *oa, uint32_t index)
+{
+    oa->nodes[index].size = 0;
+    oa->free_nodes[oa->num_free_nodes++] = index;
+}
+
+Offset_Allocator *offset_allocator_create(uint32_t size, uint32_t max_allocations, struct Allocator *a)
+{
+    check(size != 0 && max_allocations != 0);
+
+    Offset_Allocator *oa = c_alloc(a, sizeof(*oa));
+    memset(oa, 0, sizeof(*oa));
+    oa->size = size;
+    oa->max_allocations = max_allocations;
+    // Free regions are never adjacent, so there is at most one more of them than allocations
+    oa->max_nodes = max_allocations * 2 + 1;
+    oa->nodes = c_alloc(a, oa->max_nodes * sizeof(*oa->nodes));
+    oa->free_nodes = c_alloc(a, oa->max_nodes * sizeof(*oa->free_nodes));
+    oa->allocator = a;
+
+    offset_allocator_reset(oa);
+    return oa;
+}
+
+void offset_allocator_destroy(Offset_Allocator *oa)
+{
+    struct Allocator *a = oa->allocator;
+    c_free(a, oa->free_nodes, oa->max_nodes * sizeof(*oa->free_nodes));
+    c_free(a, oa->nodes, oa->max_nodes * sizeof(*oa->nodes));
+    c_free(a, oa, sizeof(*oa));
+}
+
+void offset_allocator_reset(Offset_Allocator *oa)
+{
+    oa->num_allocations = 0;
+    oa->num_free_regions = 0;
+    oa->free_storage = 0;
+    oa->used_bins_top = 0;
+    memset(oa->used_bins, 0, sizeof(oa->used_bins));
+    memset(oa->bin_heads, 0xff, sizeof(oa->bin_heads));
+    memset(oa->nodes, 0, oa->max_nodes * sizeof(*oa->nodes));
+
+    // Hand out low node indices first
+    oa->num_free_nodes = oa->max_nodes;
+    for (uint32_t i = 0; i < oa->max_nodes; ++i)
+    {
+        oa->free_nodes[i] = oa->max_nodes - i - 1;
+    }
+
+    private__insert_free_node(oa, 0, oa->size);
+}
+
+Offset_Allocation offset_allocator_allocate(Offset_Allocator *oa, uint32_t size)
+{
+    const Offset_Allocation no_space = { .offset = OFFSET_ALLOCATION_NO_SPACE, .handle = OFFSET_ALLOCATION_NO_SPACE };
+    if (!size || oa->num_allocations == oa->max_allocations)
+    {
+        return no_space;
+    }
+
+    // Smallest non-empty bin whose sizes all fit `size`
+    const uint32_t min_bin = private__bin_round_up(size);
+    const uint32_t min_top = min_bin >> OA_TOP_BINS_INDEX_SHIFT;
+    const uint32_t min_leaf = min_bin & OA_LEAF_BINS_INDEX_MASK;
+
+    uint32_t top = min_top;
+    uint32_t leaf = OA_UNUSED;
+    if (top < OA_NUM_TOP_BINS && (oa->used_bins_top & (1u << top)))
+    {
+        leaf = private__lowest_bit_after(oa->used_bins[top], min_leaf);
+    }
+    if (leaf == OA_UNUSED)
+    {
+        top = private__lowest_bit_after(oa->used_bins_top, min_top + 1);
+        if (top == OA_UNUSED)
+        {
+            return no_space;
+        }
+        leaf = c_lowest_bit32(oa->used_bins[top]);
+    }
+
+    const uint32_t index = oa->bin_heads[(top << OA_TOP_BINS_INDEX_SHIFT) | leaf];
+    private__unlink_free_node(oa, index);
+
+    Offset_Allocator_Node *node = oa->nodes + index;
+    const uint32_t region_size = node->size;
+    node->size = size;
+    node->used = true;
+    ++oa->num_allocations;
+
+    // The rest of the region becomes a free node right after the allocation
+    if (region_size > size)
+    {
+        const uint32_t rest = private__insert_free_node(oa, node->offset + size, region_size - size);
+        node = oa->nodes + index;
+        oa->nodes[rest].neighbor_prev = index;
+        oa->nodes[rest].neighbor_next = node->neighbor_next;
+        if (node->neighbor_next != OA_UNUSED)
+        {
+            oa->nodes[node->neighbor_next].neighbor_prev = rest;
+        }
+        node->neighbor_next = rest;
+    }
+
+    return (Offset_Allocation) { .offset = node->offset, .handle = index };
+}
+
+void offset_allocator_free(Offset_Allocator *oa, Offset_Allocation allocation)
+{
+    if (allocation.handle == OFFSET_ALLOCATION_NO_SPACE)
+    {
+        return;
+    }
+
+    const uint32_t index = allocation.handle;
+    Offset_Allocator_Node *node = oa->nodes + index;
+    check(node->used);
+
+    uint32_t offset = node->offset;
+    uint32_t size = node->size;
+    uint32_t neighbor_prev = node->neighbor_prev;
+    uint32_t neighbor_next = node->neighbor_next;
+
+    // Merge with free neighbours
+    if (neighbor_prev != OA_UNUSED && !oa->nodes[neighbor_prev].used)
+    {
+        const Offset_Allocator_Node *prev = oa->nodes + neighbor_prev;
+        offset = prev->offset;
+        size += prev->size;
+        private__unlink_free_node(oa, neighbor_prev);
+        const uint32_t prev_prev = prev->neighbor_prev;
+        private__release_node(oa, neighbor_prev);
+        neighbor_prev = prev_prev;
+    }
+    if (neighbor_next != OA_UNUSED && !oa->nodes[neighbor_next].used)
+    {
+        const Offset_Allocator_Node *next = oa->nodes + neighbor_next;
+        size += next->size;
+        private__unlink_free_node(oa, neighbor_next);
+        const uint32_t next_next = next->neighbor_next;
+        private__release_node(oa, neighbor_next);
+        neighbor_next = next_next;
+    }
+
+    node->used = false;
+    private__release_node(oa, index);
+    --oa->num_allocations;
+
+    const uint32_t merged = private__insert_free_node(oa, offset, size);
+    oa->nodes[merged].neighbor_prev = neighbor_prev;
+    oa->nodes[merged].neighbor_next = neighbor_next;
+    if (neighbor_prev != OA_UNUSED)
+    {
+        oa->nodes[neighbor_prev].neighbor_next = merged;
+    }
+    if (neighbor_next != OA_UNUSED)
+    {
+        oa->nodes[neighbor_next].neighbor_prev = merged;
+    }
+}
+
+uint32_t offset_allocator_allocation_size(const Offset_Allocator *oa, Offset_Allocation allocation)
+{
+    return allocation.handle != OFFSET_ALLOCATION_NO_SPACE ? oa->nodes[allocation.handle].size : 0;
+}
+
+uint32_t offset_allocator_allocation_offset(const Offset_Allocator *oa, Offset_Allocation allocation)
+{
+    return allocation.handle != OFFSET_ALLOCATION_NO_SPACE ? oa->nodes[allocation.handle].offset : OFFSET_ALLOCATION_NO_SPACE;
+}
+
+Offset_Allocator_Report offset_allocator_report(const Offset_Allocator *oa)
+{
+    Offset_Allocator_Report report = {
+        .total_free = oa->free_storage,
+        .num_free_regions = oa->num_free_regions,
+        .num_allocations = oa->num_allocations,
+    };
+
+    // The largest free region is in the highest non-empty bin
+    if (oa->used_bins_top)
+    {
+        const uint32_t top = c_highest_bit32(oa->used_bins_top);
+        const uint32_t leaf = c_highest_bit32(oa->used_bins[top]);
+        for (uint32_t i = oa->bin_heads[(top << OA_TOP_BINS_INDEX_SHIFT) | leaf]; i != OA_UNUSED; i = oa->nodes[i].bin_next)
+        {
+            report.largest_free_region = c_max(report.largest_free_region, oa->nodes[i].size);
+        }
+    }
+
+    report.fragmentation = report.total_free ? 1.f - (float)((double)report.largest_free_region / (double)report.total_free) : 0.f;
+    return report;
+}
+
+// Node at offset 0, where the neighbour list starts
+static uint32_t private__first_node(const Offset_Allocator *oa)
+{
+    for (uint32_t i = 0; i < oa->max_nodes; ++i)
+    {
+        const Offset_Allocator_Node *node = oa->nodes + i;
+        if (node->size && node->offset == 0)
+        {
+            return i;
+        }
+    }
+    return OA_UNUSED;
+}
+
+Offset_Allocator_Move *offset_allocator_defragment_plan(const Offset_Allocator *oa, struct Allocator *a)
+{
+    Offset_Allocator_Move *moves = 0;
+    uint32_t cursor = 0;
+    for (uint32_t i = private__first_node(oa); i != OA_UNUSED; i = oa->nodes[i].neighbor_next)
+    {
+        const Offset_Allocator_Node *node = oa->nodes + i;
+        if (!node->used)
+        {
+            continue;
+        }
+        if (node->offset != cursor)
+        {
+            const Offset_Allocator_Move move = {
+                .handle = i,
+                .src_offset = node->offset,
+                .dst_offset = cursor,
+                .size = node->size,
+            };
+            array_push(moves, move, a);
+        }
+        cursor += node->size;
+    }
+    return moves;
+}
+
+void offset_allocator_apply_defragment(Offset_Allocator *oa)
+{
+    uint32_t cursor = 0;
+    uint32_t last_used = OA_UNUSED;
+    uint32_t i = private__first_node(oa);
+    while (i != OA_UNUSED)
+    {
+        Offset_Allocator_Node *node = oa->nodes + i;
+        const uint32_t next = node->neighbor_next;
+        if (node->used)
+        {
+            node->offset = cursor;
+            node->neighbor_prev = last_used;
+            if (last_used != OA_UNUSED)
+            {
+                oa->nodes[last_used].neighbor_next = i;
+            }
+            cursor += node->size;
+            last_used = i;
+        }
+        else
+        {
+            private__unlink_free_node(oa, i);
+            private__release_node(oa, i);
+        }
+        i = next;
+    }
+
+    uint32_t rest = OA_UNUSED;
+    if (cursor < oa->size)
+    {
+        rest = private__insert_free_node(oa, cursor, oa->size - cursor);
+        oa->nodes[rest].neighbor_prev = last_used;
+    }
+    if (last_used != OA_UNUSED)
+    {
+        oa->nodes[last_used].neighbor_next = rest;
+    }
+}
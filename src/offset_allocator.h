@@ -0,0 +1,64 @@
+#pragma once
+#include "basic.h"
+
+struct Allocator;
+
+// Allocates ranges of offsets inside memory it never touches, e.g. vertex data inside a large
+// `gfx_id` buffer. Allocation and freeing are O(1): free ranges are kept in 256 bins of
+// logarithmically spaced sizes, found with a two-level bitmap.
+typedef struct Offset_Allocator Offset_Allocator;
+
+#define OFFSET_ALLOCATION_NO_SPACE 0xffffffffu
+
+typedef struct Offset_Allocation {
+    uint32_t offset;
+    // Identifies the allocation when freeing it, `OFFSET_ALLOCATION_NO_SPACE` if it failed
+    uint32_t handle;
+} Offset_Allocation;
+
+typedef struct Offset_Allocator_Report {
+    uint32_t total_free;
+    uint32_t largest_free_region;
+    uint32_t num_free_regions;
+    uint32_t num_allocations;
+    // 1 - largest_free_region / total_free, 0 when all free space is in one region
+    float fragmentation;
+} Offset_Allocator_Report;
+
+// Moving the data of allocation `handle` from `src_offset` to `dst_offset` is part of a defragmentation
+typedef struct Offset_Allocator_Move {
+    uint32_t handle;
+    uint32_t src_offset;
+    uint32_t dst_offset;
+    uint32_t size;
+} Offset_Allocator_Move;
+
+// Manages offsets [0, size) for up to `max_allocations` live allocations, bookkeeping comes from `a`
+Offset_Allocator *offset_allocator_create(uint32_t size, uint32_t max_allocations, struct Allocator *a);
+
+void offset_allocator_destroy(Offset_Allocator *oa);
+
+// Frees all allocations
+void offset_allocator_reset(Offset_Allocator *oa);
+
+// Returns an allocation with `handle` set to `OFFSET_ALLOCATION_NO_SPACE` if there's no free
+// range of `size` or the maximum number of allocations is reached
+Offset_Allocation offset_allocator_allocate(Offset_Allocator *oa, uint32_t size);
+
+void offset_allocator_free(Offset_Allocator *oa, Offset_Allocation allocation);
+
+uint32_t offset_allocator_allocation_size(const Offset_Allocator *oa, Offset_Allocation allocation);
+
+// Current offset of `allocation`, which changes when the allocator is defragmented
+uint32_t offset_allocator_allocation_offset(const Offset_Allocator *oa, Offset_Allocation allocation);
+
+Offset_Allocator_Report offset_allocator_report(const Offset_Allocator *oa);
+
+// Returns an `array.h` array, allocated from `a`, of the moves that pack all allocations to the
+// start of the range in address order. Moves are sorted by offset, their destination is always
+// below their source but ranges may overlap. Doesn't change the allocator.
+Offset_Allocator_Move *offset_allocator_defragment_plan(const Offset_Allocator *oa, struct Allocator *a);
+
+// Updates the allocator to the layout of `offset_allocator_defragment_plan()` once the data has
+// been moved. Handles stay valid, so allocations keep their handle and get the plan's offset.
+void offset_allocator_apply_defragment(Offset_Allocator *oa);
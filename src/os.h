@@ -101,6 +101,12 @@ void os_release(void *mem);
 void os_commit(void *mem, uint64_t size);
 void os_decommit(void *mem, uint64_t size);
 
+// Size of the large pages that can back memory committed with `os_commit()`, `PAGE_SIZE` if there are none
+uint64_t os_large_page_size();
+
+// Asks the OS to back [mem, mem + size) of a reservation with large pages once it is committed
+void os_advise_large_pages(void *mem, uint64_t size);
+
 // Debugging
 
 void os_print_stack_trace();
@@ -0,0 +1,638 @@
+#if defined(OS_LINUX)
+
+#include "os.h"
+#include "array.h"
+#include "allocator.h"
+#include "atomics.inl"
+#include "log.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static inline void futex_wait(volatile AtomicU32 *addr, uint32_t expected)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, 0, 0, 0);
+}
+
+static inline void futex_wake(volatile AtomicU32 *addr, uint32_t count)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, 0, 0, 0);
+}
+
+void *os_read_entire_file(const char *path, uint64_t *size, struct Allocator *a)
+{
+    File_Handle file = os_open_file_input(path);
+    if (!file.valid)
+    {
+        log_error("Unable to find file '%s'", path);
+        return 0;
+    }
+
+    uint64_t file_size = os_file_size(file);
+    void *buffer = c_alloc(a, file_size);
+
+    int64_t result = os_read_file(file, buffer, file_size);
+    if (result == -1)
+    {
+        log_error("Failed to read file '%s'", path);
+    }
+    if ((uint64_t)result != file_size)
+    {
+        log_error("Failed to read entire file '%s'", path);
+    }
+    *size = file_size;
+
+    os_close_file(file);
+
+    return buffer;
+}
+
+void os_write_to_file(const char *path, const uint8_t *data, uint64_t size)
+{
+    File_Handle file = os_open_file_output(path);
+    if (!file.valid)
+    {
+        log_error("Unable to open file '%s'", path);
+        return;
+    }
+    bool success = os_write_file(file, data, size);
+    if (!success)
+    {
+        log_error("Failed to write to file '%s'", path);
+    }
+    os_close_file(file);
+}
+
+uint32_t os_num_logical_processors()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (uint32_t)count : 1;
+}
+
+uint32_t os_thread_id()
+{
+    return (uint32_t)syscall(SYS_gettid);
+}
+
+uint32_t os_thread_id_from_handle(Thread_Handle handle)
+{
+    return (uint32_t)handle.opaque[1];
+}
+
+struct Thread_Data
+{
+    thread_entry_func *entry_point;
+    void *user_data;
+    AtomicU32 thread_id;
+    // The creator and the new thread both release their reference, the last one frees the data
+    AtomicU32 references;
+};
+
+static void private__release_thread_data(struct Thread_Data *thread_data)
+{
+    if (atomic_fetch_sub_32(&thread_data->references, 1) == 1)
+    {
+        c_free(system_allocator, thread_data, sizeof(struct Thread_Data));
+    }
+}
+
+static void *thread_proc(void *data)
+{
+    struct Thread_Data *thread_data_ptr = (struct Thread_Data *)data;
+    struct Thread_Data thread_data = *thread_data_ptr;
+
+    // Publish the kernel thread id, the wake still needs the data so it is released after that
+    atomic_store_32(&thread_data_ptr->thread_id, os_thread_id());
+    futex_wake(&thread_data_ptr->thread_id, 1);
+    private__release_thread_data(thread_data_ptr);
+
+    thread_data.entry_point(thread_data.user_data);
+
+    return 0;
+}
+
+Thread_Handle os_create_thread(thread_entry_func *entry_point, void *user_data, uint32_t stack_size)
+{
+    struct Thread_Data *thread_data = c_alloc(system_allocator, sizeof(struct Thread_Data));
+    thread_data->entry_point = entry_point;
+    thread_data->user_data = user_data;
+    thread_data->thread_id = 0;
+    thread_data->references = 2;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (stack_size >= PTHREAD_STACK_MIN)
+    {
+        pthread_attr_setstacksize(&attr, stack_size);
+    }
+
+    pthread_t handle;
+    int result = pthread_create(&handle, &attr, thread_proc, thread_data);
+    pthread_attr_destroy(&attr);
+    fatal_checkf(result == 0, "Failed to create thread!");
+
+    uint32_t thread_id;
+    while ((thread_id = atomic_load_32(&thread_data->thread_id)) == 0)
+    {
+        futex_wait(&thread_data->thread_id, 0);
+    }
+    private__release_thread_data(thread_data);
+
+    Thread_Handle thread = { 0 };
+    memcpy(&thread, &handle, sizeof(handle));
+    thread.opaque[1] = thread_id;
+
+    return thread;
+}
+
+void os_wait_for_thread(Thread_Handle thread)
+{
+    pthread_t handle;
+    memcpy(&handle, &thread, sizeof(handle));
+    pthread_join(handle, 0);
+}
+
+void os_sleep(double seconds)
+{
+    struct timespec ts = {
+        .tv_sec = (time_t)seconds,
+        .tv_nsec = (long)((seconds - (double)(time_t)seconds) * 1e9),
+    };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+void os_yield_processor()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+typedef struct Fiber_Context {
+    ucontext_t context;
+    fiber_entry_func *entry;
+    void *user_data;
+    void *stack;
+    uint64_t stack_size;
+} Fiber_Context;
+
+static THREAD_LOCAL Fiber_Context *current_fiber = 0;
+
+// Fibers may be resumed on another thread, so the thread-local must be re-read after every switch
+static NO_INLINE Fiber_Context *get_current_fiber()
+{
+    return current_fiber;
+}
+
+static NO_INLINE void set_current_fiber(Fiber_Context *context)
+{
+    current_fiber = context;
+}
+
+static void fiber_proc()
+{
+    Fiber_Context *context = get_current_fiber();
+    context->entry(context->user_data);
+}
+
+Fiber_Handle os_convert_thread_to_fiber(void *user_data)
+{
+    Fiber_Context *context = c_alloc(system_allocator, sizeof(Fiber_Context));
+    memset(context, 0, sizeof(*context));
+    context->user_data = user_data;
+    set_current_fiber(context);
+    Fiber_Handle handle;
+    memcpy(&handle, &context, sizeof(context));
+    return handle;
+}
+
+void os_convert_fiber_to_thread()
+{
+    Fiber_Context *context = get_current_fiber();
+    if (context && !context->stack)
+    {
+        c_free(system_allocator, context, sizeof(Fiber_Context));
+    }
+    set_current_fiber(0);
+}
+
+Fiber_Handle os_create_fiber(fiber_entry_func *entry, void *user_data, uint32_t stack_size)
+{
+    Fiber_Context *context = c_alloc(system_allocator, sizeof(Fiber_Context));
+    memset(context, 0, sizeof(*context));
+    context->entry = entry;
+    context->user_data = user_data;
+
+    // Stack with a guard page at the bottom to catch overflows
+    const uint64_t size = ALIGN_SIZE((uint64_t)c_max(stack_size, KB(64)), PAGE_SIZE) + PAGE_SIZE;
+    uint8_t *stack = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    fatal_checkf(stack != MAP_FAILED, "Failed to allocate fiber stack!");
+    mprotect(stack, PAGE_SIZE, PROT_NONE);
+    context->stack = stack;
+    context->stack_size = size;
+
+    getcontext(&context->context);
+    context->context.uc_stack.ss_sp = stack + PAGE_SIZE;
+    context->context.uc_stack.ss_size = size - PAGE_SIZE;
+    context->context.uc_link = 0;
+    makecontext(&context->context, fiber_proc, 0);
+
+    Fiber_Handle handle;
+    memcpy(&handle, &context, sizeof(context));
+    return handle;
+}
+
+void os_destroy_fiber(Fiber_Handle handle)
+{
+    Fiber_Context *context = (Fiber_Context *)handle.opaque;
+    if (context->stack)
+    {
+        munmap(context->stack, context->stack_size);
+    }
+    c_free(system_allocator, context, sizeof(Fiber_Context));
+}
+
+void os_switch_to_fiber(Fiber_Handle handle)
+{
+    Fiber_Context *from = get_current_fiber();
+    Fiber_Context *to = (Fiber_Context *)handle.opaque;
+    fatal_checkf(from, "Thread must be converted to a fiber before switching!");
+    set_current_fiber(to);
+    swapcontext(&from->context, &to->context);
+}
+
+void *os_fiber_user_data()
+{
+    Fiber_Context *context = get_current_fiber();
+    return context ? context->user_data : 0;
+}
+
+// The critical section is a futex-backed mutex stored in the first 32 bits of the opaque value:
+// 0 = unlocked, 1 = locked, 2 = locked with (possible) waiters. A zeroed section is unlocked.
+void os_create_critical_section(Critical_Section *cs)
+{
+    cs->opaque = 0;
+}
+
+void os_enter_critical_section(Critical_Section *cs)
+{
+    volatile AtomicU32 *state = (volatile AtomicU32 *)&cs->opaque;
+    uint32_t c = atomic_compare_exchange_32(state, 0, 1);
+    if (c == 0)
+    {
+        return;
+    }
+    if (c != 2)
+    {
+        c = atomic_exchange_32(state, 2);
+    }
+    while (c != 0)
+    {
+        futex_wait(state, 2);
+        c = atomic_exchange_32(state, 2);
+    }
+}
+
+void os_leave_critical_section(Critical_Section *cs)
+{
+    volatile AtomicU32 *state = (volatile AtomicU32 *)&cs->opaque;
+    if (atomic_fetch_sub_32(state, 1) != 1)
+    {
+        atomic_store_32(state, 0);
+        futex_wake(state, 1);
+    }
+}
+
+typedef struct Semaphore {
+    AtomicU32 count;
+    AtomicU32 waiters;
+} Semaphore;
+
+Semaphore_Handle os_create_semaphore(uint32_t initial_count)
+{
+    Semaphore *sem = c_alloc(system_allocator, sizeof(Semaphore));
+    sem->count = initial_count;
+    sem->waiters = 0;
+    Semaphore_Handle handle;
+    handle.opaque = (uint64_t)sem;
+    return handle;
+}
+
+void os_semaphore_add(Semaphore_Handle handle, uint32_t count)
+{
+    Semaphore *sem = (Semaphore *)handle.opaque;
+    atomic_fetch_add_32(&sem->count, count);
+    if (atomic_load_32(&sem->waiters))
+    {
+        futex_wake(&sem->count, count);
+    }
+}
+
+void os_semaphore_wait(Semaphore_Handle handle)
+{
+    Semaphore *sem = (Semaphore *)handle.opaque;
+    while (!os_semaphore_poll(handle))
+    {
+        atomic_fetch_add_32(&sem->waiters, 1);
+        futex_wait(&sem->count, 0);
+        atomic_fetch_sub_32(&sem->waiters, 1);
+    }
+}
+
+bool os_semaphore_poll(Semaphore_Handle handle)
+{
+    Semaphore *sem = (Semaphore *)handle.opaque;
+    uint32_t count = atomic_load_32(&sem->count);
+    while (count > 0)
+    {
+        const uint32_t prev = atomic_compare_exchange_32(&sem->count, count, count - 1);
+        if (prev == count)
+        {
+            return true;
+        }
+        count = prev;
+    }
+    return false;
+}
+
+void os_destroy_semaphore(Semaphore_Handle handle)
+{
+    c_free(system_allocator, (Semaphore *)handle.opaque, sizeof(Semaphore));
+}
+
+Time_Stamp os_time_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    Time_Stamp result;
+    result.opaque = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    return result;
+}
+
+double os_time_delta(Time_Stamp to, Time_Stamp from)
+{
+    int64_t delta = to.opaque - from.opaque;
+    return (double)delta / 1e9;
+}
+
+Time_Stamp os_time_add(Time_Stamp from, double seconds)
+{
+    Time_Stamp result;
+    result.opaque = from.opaque + (int64_t)(seconds * 1e9);
+    return result;
+}
+
+static File_Handle open_file(const char *path, int flags)
+{
+    int fd = open(path, flags | O_CLOEXEC, 0644);
+    return (File_Handle) { .handle = (uint64_t)fd, .valid = fd != -1 };
+}
+
+File_Handle os_open_file_input(const char *path)
+{
+    return open_file(path, O_RDONLY);
+}
+
+File_Handle os_open_file_output(const char *path)
+{
+    return open_file(path, O_RDWR | O_CREAT | O_TRUNC);
+}
+
+File_Handle os_open_file_append(const char *path)
+{
+    return open_file(path, O_RDWR | O_CREAT);
+}
+
+void os_file_set_position(File_Handle file, uint64_t pos)
+{
+    if (!file.valid) return;
+    lseek((int)file.handle, (off_t)pos, SEEK_SET);
+}
+
+uint64_t os_file_size(File_Handle file)
+{
+    if (!file.valid) return 0;
+    struct stat st;
+    if (fstat((int)file.handle, &st) != 0) return 0;
+    return (uint64_t)st.st_size;
+}
+
+int64_t os_read_file(File_Handle file, void *buffer, uint64_t size)
+{
+    return os_read_file_at(file, 0, buffer, size);
+}
+
+int64_t os_read_file_at(File_Handle file, uint64_t start_offset, void *buffer, uint64_t size)
+{
+    if (!file.valid) return -1;
+    uint64_t offset = 0;
+    while (offset < size)
+    {
+        const ssize_t bytes_read = pread((int)file.handle, (uint8_t *)buffer + offset, size - offset, (off_t)(start_offset + offset));
+        if (bytes_read == -1)
+        {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (!bytes_read)
+        {
+            break;
+        }
+        offset += bytes_read;
+    }
+    return offset;
+}
+
+bool os_write_file(File_Handle file, const void *buffer, uint64_t size)
+{
+    return os_write_file_at(file, 0, buffer, size);
+}
+
+bool os_write_file_at(File_Handle file, uint64_t start_offset, const void *buffer, uint64_t size)
+{
+    if (!file.valid) return false;
+    uint64_t offset = 0;
+    while (offset < size)
+    {
+        const ssize_t bytes_written = pwrite((int)file.handle, (const uint8_t *)buffer + offset, size - offset, (off_t)(start_offset + offset));
+        if (bytes_written == -1)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        offset += bytes_written;
+    }
+    return true;
+}
+
+void os_close_file(File_Handle file)
+{
+    if (!file.valid) return;
+    close((int)file.handle);
+}
+
+// `munmap()` needs the size of the mapping, so every reservation is prefixed with a
+// committed header page that remembers it
+void *os_reserve(uint64_t size)
+{
+    const uint64_t total_size = ALIGN_SIZE(size, PAGE_SIZE) + PAGE_SIZE;
+    uint8_t *base = mmap(0, total_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        return 0;
+    }
+    mprotect(base, PAGE_SIZE, PROT_READ | PROT_WRITE);
+    *(uint64_t *)base = total_size;
+    return base + PAGE_SIZE;
+}
+
+void os_release(void *mem)
+{
+    if (!mem) return;
+    uint8_t *base = (uint8_t *)mem - PAGE_SIZE;
+    munmap(base, *(uint64_t *)base);
+}
+
+// Expand [mem, mem + size) to whole pages, like `VirtualAlloc()`/`VirtualFree()` do
+static inline uint64_t page_range(void *mem, uint64_t size, uint8_t **start)
+{
+    const uint64_t begin = (uint64_t)mem & ~(uint64_t)(PAGE_SIZE - 1);
+    const uint64_t end = ALIGN_SIZE((uint64_t)mem + size, PAGE_SIZE);
+    *start = (uint8_t *)begin;
+    return end - begin;
+}
+
+void os_commit(void *mem, uint64_t size)
+{
+    if (!size) return;
+    uint8_t *start;
+    const uint64_t len = page_range(mem, size, &start);
+    mprotect(start, len, PROT_READ | PROT_WRITE);
+}
+
+void os_decommit(void *mem, uint64_t size)
+{
+    if (!size) return;
+    uint8_t *start;
+    const uint64_t len = page_range(mem, size, &start);
+    madvise(start, len, MADV_DONTNEED);
+    mprotect(start, len, PROT_NONE);
+}
+
+// Transparent huge pages are PMD sized, 2 MB with 4 KB base pages
+uint64_t os_large_page_size()
+{
+    return MB(2);
+}
+
+void os_advise_large_pages(void *mem, uint64_t size)
+{
+    if (!size) return;
+    uint8_t *start;
+    const uint64_t len = page_range(mem, size, &start);
+    madvise(start, len, MADV_HUGEPAGE);
+}
+
+enum {
+    MAX_STACK_FRAMES = 64
+};
+
+void os_print_stack_trace()
+{
+    void *frames[MAX_STACK_FRAMES];
+    const int num_frames = backtrace(frames, MAX_STACK_FRAMES);
+    char **symbols = backtrace_symbols(frames, num_frames);
+    if (!symbols)
+    {
+        return;
+    }
+
+    log_trace("Stack Trace:");
+    // Skip this function
+    for (int i = 1; i < num_frames; ++i)
+    {
+        log_trace("%-3i %s", i - 1, symbols[i]);
+    }
+    log_trace("---");
+    free(symbols);
+}
+
+void os_find_files_recursive(const char *root, File_Info **files, struct Allocator *a)
+{
+    DIR *dir = opendir(root);
+    if (!dir)
+    {
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)))
+    {
+        // ignore '.' and '..' directories as well as hidden files and directories
+        if (entry->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        File_Info info;
+        snprintf(info.path, 260, "%s/%s", root, entry->d_name);
+
+        // Symbolic links are not followed into directories, they could form a cycle
+        struct stat st;
+        if (lstat(info.path, &st) != 0)
+        {
+            continue;
+        }
+        if (S_ISLNK(st.st_mode) && (stat(info.path, &st) != 0 || S_ISDIR(st.st_mode)))
+        {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode))
+        {
+            os_find_files_recursive(info.path, files, a);
+        }
+        else
+        {
+            array_push(*files, info, a);
+        }
+    }
+    closedir(dir);
+}
+
+// There is no clipboard or native dialogs without a windowing system, these are no-ops on Linux
+
+String8 os_get_clipboard_text_utf8(struct Allocator *a)
+{
+    return (String8) { 0 };
+}
+
+void os_set_clipboard_text_utf8(struct Allocator *a, String8 data)
+{
+}
+
+String8 os_open_file_dialog(struct Allocator *a)
+{
+    return (String8) { 0 };
+}
+
+String8 os_save_file_dialog(struct Allocator *a)
+{
+    return (String8) { 0 };
+}
+
+#endif
@@ -4,6 +4,7 @@
 #include "array.h"
 #include "unicode.h"
 #include "allocator.h"
+#include "scratch_allocator.h"
 #include "atomics.inl"
 #include "log.h"
 #include "string_util.h"
@@ -158,8 +159,7 @@ static void __stdcall fiber_proc(void *params)
 
 Fiber_Handle os_convert_thread_to_fiber(void *user_data)
 {
-    Fiber_Context *context = &fiber_registry[next_fiber_idx];
-    atomic_fetch_sub_32(&next_fiber_idx, 1);
+    Fiber_Context *context = &fiber_registry[atomic_fetch_add_32(&next_fiber_idx, 1)];
     context->entry = 0;
     context->user_data = user_data;
     void *fiber = ConvertThreadToFiberEx(context, FIBER_FLAG_FLOAT_SWITCH);
@@ -175,8 +175,7 @@ void os_convert_fiber_to_thread()
 
 Fiber_Handle os_create_fiber(fiber_entry_func *entry, void *user_data, uint32_t stack_size)
 {
-    Fiber_Context *context = &fiber_registry[next_fiber_idx];
-    atomic_fetch_add_32(&next_fiber_idx, 1);
+    Fiber_Context *context = &fiber_registry[atomic_fetch_add_32(&next_fiber_idx, 1)];
     context->entry = entry;
     context->user_data = user_data;
     void *fiber = CreateFiberEx(stack_size, stack_size, FIBER_FLAG_FLOAT_SWITCH, fiber_proc, context);
@@ -275,25 +274,28 @@ Time_Stamp os_time_add(Time_Stamp from, double seconds)
 
 File_Handle os_open_file_input(const char *path)
 {
-    String16 wpath = utf8_to_utf16(path, system_allocator);
+    Scratch scratch = scratch_begin(0);
+    String16 wpath = utf8_to_utf16(path, scratch.a);
     HANDLE handle = CreateFileW(wpath.str, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
-    c_free(system_allocator, wpath.str, (wpath.len + 1) * sizeof(uint16_t));
+    scratch_end(scratch);
     return (File_Handle) { .handle = (uint64_t)handle, .valid = handle != INVALID_HANDLE_VALUE };
 }
 
 File_Handle os_open_file_output(const char *path)
 {
-    String16 wpath = utf8_to_utf16(path, system_allocator);
+    Scratch scratch = scratch_begin(0);
+    String16 wpath = utf8_to_utf16(path, scratch.a);
     HANDLE handle = CreateFileW(wpath.str, GENERIC_WRITE | GENERIC_READ, FILE_SHARE_READ, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
-     c_free(system_allocator, wpath.str, (wpath.len + 1) * sizeof(uint16_t));
+    scratch_end(scratch);
     return (File_Handle) { .handle = (uint64_t)handle, .valid = handle != INVALID_HANDLE_VALUE };
 }
 
 File_Handle os_open_file_append(const char *path)
 {
-    String16 wpath = utf8_to_utf16(path, system_allocator);
+    Scratch scratch = scratch_begin(0);
+    String16 wpath = utf8_to_utf16(path, scratch.a);
     HANDLE handle = CreateFileW(wpath.str, GENERIC_WRITE | GENERIC_READ, FILE_SHARE_READ, 0, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
-    c_free(system_allocator, wpath.str, (wpath.len + 1) * sizeof(uint16_t));
+    scratch_end(scratch);
     return (File_Handle) { .handle = (uint64_t)handle, .valid = handle != INVALID_HANDLE_VALUE };
 }
 
@@ -400,6 +402,17 @@ void os_decommit(void *mem, uint64_t size)
     VirtualFree(mem, size, MEM_DECOMMIT);
 }
 
+// `MEM_LARGE_PAGES` memory has to be committed when it is reserved and needs the lock pages
+// privilege, so memory committed on demand never uses large pages
+uint64_t os_large_page_size()
+{
+    return PAGE_SIZE;
+}
+
+void os_advise_large_pages(void *mem, uint64_t size)
+{
+}
+
 typedef struct Stack_Frame {
     DWORD64 address;
     const char *name;
@@ -555,12 +568,14 @@ void os_set_clipboard_text_utf8(struct Allocator *a, String8 data)
     OpenClipboard(NULL);
     EmptyClipboard();
 
-    String16 wstr = utf8_to_utf16_n(data.str, data.len, a);
+    Scratch scratch = scratch_begin(a);
+    String16 wstr = utf8_to_utf16_n(data.str, data.len, scratch.a);
     HGLOBAL h = GlobalAlloc(GMEM_MOVEABLE, (wstr.len + 1) * 2);
     char *p = GlobalLock(h);
     memcpy(p, wstr.str, 2 * (wstr.len + 1));
     GlobalUnlock(h);
     SetClipboardData(CF_UNICODETEXT, h);
+    scratch_end(scratch);
     
     CloseClipboard();
 }
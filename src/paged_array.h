@@ -0,0 +1,117 @@
+#pragma once
+#include "basic.h"
+#include "allocator.h"
+#include "array.h"
+#include "log.h"
+
+#include <string.h>
+
+// Array of `item_size` sized items stored in fixed size pages that are allocated as it grows.
+// Items never move, so pointers to them stay valid until the array is freed, and growing never
+// copies items, only the page directory is reallocated. There is no upper bound on the size.
+// Item `i` lives at slot `i & page_mask` of page `i >> page_shift`, so lookups are a shift, a mask
+// and one load from the directory.
+typedef struct Paged_Array
+{
+    uint64_t item_size;
+    uint64_t size;
+    // Each page holds `1 << page_shift` items
+    uint32_t page_shift;
+    uint32_t padding;
+    // Array of pages, see array.h
+    uint8_t **pages;
+    struct Allocator *allocator;
+} Paged_Array;
+
+enum {
+    // Pages are sized to fit as many items as possible within this size when no item count is given
+    PAGED_ARRAY_DEFAULT_PAGE_SIZE = KB(64),
+};
+
+// Number of items each page holds
+#define paged_array_page_count(pa) \
+    ((uint64_t)1 << (pa)->page_shift)
+
+// Number of items that fit in the allocated pages
+#define paged_array_capacity(pa) \
+    (array_size((pa)->pages) << (pa)->page_shift)
+
+// Pointer to item `i` cast to `T *`
+#define paged_array_get_typed(pa, T, i) \
+    ((T *)paged_array_get(pa, i))
+
+// `items_per_page` is rounded up to a power of two, 0 picks it from `PAGED_ARRAY_DEFAULT_PAGE_SIZE`
+static inline void paged_array_init(Paged_Array *pa, uint64_t item_size, uint64_t items_per_page, struct Allocator *a)
+{
+    check(item_size);
+    uint32_t shift = 0;
+    if (items_per_page)
+    {
+        while (((uint64_t)1 << shift) < items_per_page)
+            ++shift;
+    }
+    else
+    {
+        // Round down so pages stay within the default page size
+        while ((item_size << (shift + 1)) <= PAGED_ARRAY_DEFAULT_PAGE_SIZE)
+            ++shift;
+    }
+
+    *pa = (Paged_Array) {
+        .item_size = item_size,
+        .page_shift = shift,
+        .allocator = a,
+    };
+}
+
+// Item `i` of the array, it must be below the size
+static inline void *paged_array_get(const Paged_Array *pa, uint64_t i)
+{
+    check(i < pa->size);
+    const uint64_t slot = i & (paged_array_page_count(pa) - 1);
+    return pa->pages[i >> pa->page_shift] + slot * pa->item_size;
+}
+
+// Allocates pages until at least `n` items fit, without changing the size
+static inline void paged_array_ensure(Paged_Array *pa, uint64_t n)
+{
+    while (paged_array_capacity(pa) < n)
+    {
+        uint8_t *page = c_alloc(pa->allocator, pa->item_size << pa->page_shift);
+        array_push(pa->pages, page, pa->allocator);
+    }
+}
+
+// Add a zeroed item to the end of the array and return it
+static inline void *paged_array_push(Paged_Array *pa)
+{
+    paged_array_ensure(pa, pa->size + 1);
+    void *item = paged_array_get(pa, pa->size++);
+    memset(item, 0, pa->item_size);
+    return item;
+}
+
+// Remove the last item, its memory stays allocated until the array is freed
+static inline void paged_array_pop(Paged_Array *pa)
+{
+    check(pa->size);
+    --pa->size;
+}
+
+// Clear the array without freeing any pages
+static inline void paged_array_reset(Paged_Array *pa)
+{
+    pa->size = 0;
+}
+
+// Free all pages, the array can be reused after another `paged_array_init()`
+static inline void paged_array_free(Paged_Array *pa)
+{
+    const uint64_t page_bytes = pa->item_size << pa->page_shift;
+    for (uint64_t i = 0; i < array_size(pa->pages); ++i)
+    {
+        c_free(pa->allocator, pa->pages[i], page_bytes);
+    }
+    array_free(pa->pages, pa->allocator);
+    pa->size = 0;
+}
@@ -0,0 +1,246 @@
+#include "radix_sort.h"
+#include "allocator.h"
+#include "job_system.h"
+#include "log.h"
+
+#include <string.h>
+
+enum {
+    RADIX_BITS = 8,
+    RADIX_BUCKETS = 1 << RADIX_BITS,
+    // Below this many keys insertion sort beats the histogram passes
+    RADIX_SMALL_SORT = 64,
+    // Keys per job of the parallel sort, smaller inputs use the serial sort
+    RADIX_PARALLEL_CHUNK = 1 << 16,
+    RADIX_MAX_JOBS = 64,
+};
+
+// Stamps out the serial sort for one key and value type. Histograms of every digit are counted in
+// a single read of the keys, then each pass scatters the keys and values between the input and the
+// scratch buffer.
+#define RADIX_SORT_IMPL(name, Key, Value)                                                               \
+                                                                                                        \
+static void private__insertion_sort_##name(Key *keys, Value *values, uint64_t n)                        \
+{                                                                                                       \
+    for (uint64_t i = 1; i < n; ++i)                                                                    \
+    {                                                                                                   \
+        const Key key = keys[i];                                                                        \
+        const Value value = values ? values[i] : 0;                                                     \
+        uint64_t j = i;                                                                                 \
+        for (; j > 0 && keys[j - 1] > key; --j)                                                         \
+        {                                                                                               \
+            keys[j] = keys[j - 1];                                                                      \
+            if (values)                                                                                 \
+                values[j] = values[j - 1];                                                              \
+        }                                                                                               \
+        keys[j] = key;                                                                                  \
+        if (values)                                                                                     \
+            values[j] = value;                                                                          \
+    }                                                                                                   \
+}                                                                                                       \
+                                                                                                        \
+void radix_sort_##name(Key *keys, Value *values, uint64_t n, Allocator *a)                              \
+{                                                                                                       \
+    if (n < RADIX_SMALL_SORT)                                                                           \
+    {                                                                                                   \
+        private__insertion_sort_##name(keys, values, n);                                                \
+        return;                                                                                         \
+    }                                                                                                   \
+                                                                                                        \
+    enum { NUM_DIGITS = sizeof(Key) };                                                                  \
+    uint64_t counts[NUM_DIGITS][RADIX_BUCKETS];                                                         \
+    memset(counts, 0, sizeof(counts));                                                                  \
+    for (uint64_t i = 0; i < n; ++i)                                                                    \
+    {                                                                                                   \
+        const Key key = keys[i];                                                                        \
+        for (uint32_t d = 0; d < NUM_DIGITS; ++d)                                                       \
+            ++counts[d][(key >> (d * RADIX_BITS)) & (RADIX_BUCKETS - 1)];                               \
+    }                                                                                                   \
+                                                                                                        \
+    Key *scratch_keys = c_alloc(a, n * sizeof(Key));                                                    \
+    Value *scratch_values = values ? c_alloc(a, n * sizeof(Value)) : 0;                                 \
+    Key *src_keys = keys, *dst_keys = scratch_keys;                                                     \
+    Value *src_values = values, *dst_values = scratch_values;                                           \
+                                                                                                        \
+    for (uint32_t d = 0; d < NUM_DIGITS; ++d)                                                           \
+    {                                                                                                   \
+        const uint32_t shift = d * RADIX_BITS;                                                          \
+        if (counts[d][(src_keys[0] >> shift) & (RADIX_BUCKETS - 1)] == n)                               \
+            continue;                                                                                   \
+                                                                                                        \
+        uint64_t offsets[RADIX_BUCKETS];                                                                \
+        uint64_t sum = 0;                                                                               \
+        for (uint32_t b = 0; b < RADIX_BUCKETS; ++b)                                                    \
+        {                                                                                               \
+            offsets[b] = sum;                                                                           \
+            sum += counts[d][b];                                                                        \
+        }                                                                                               \
+                                                                                                        \
+        if (values)                                                                                     \
+        {                                                                                               \
+            for (uint64_t i = 0; i < n; ++i)                                                            \
+            {                                                                                           \
+                const uint64_t o = offsets[(src_keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;             \
+                dst_keys[o] = src_keys[i];                                                              \
+                dst_values[o] = src_values[i];                                                          \
+            }                                                                                           \
+        }                                                                                               \
+        else                                                                                            \
+        {                                                                                               \
+            for (uint64_t i = 0; i < n; ++i)                                                            \
+                dst_keys[offsets[(src_keys[i] >> shift) & (RADIX_BUCKETS - 1)]++] = src_keys[i];        \
+        }                                                                                               \
+                                                                                                        \
+        Key *k = src_keys; src_keys = dst_keys; dst_keys = k;                                           \
+        Value *v = src_values; src_values = dst_values; dst_values = v;                                 \
+    }                                                                                                   \
+                                                                                                        \
+    /* An odd number of passes leaves the result in the scratch buffer */                               \
+    if (src_keys != keys)                                                                               \
+    {                                                                                                   \
+        memcpy(keys, src_keys, n * sizeof(Key));                                                        \
+        if (values)                                                                                     \
+            memcpy(values, src_values, n * sizeof(Value));                                              \
+    }                                                                                                   \
+                                                                                                        \
+    c_free(a, scratch_keys, n * sizeof(Key));                                                           \
+    if (values)                                                                                         \
+        c_free(a, scratch_values, n * sizeof(Value));                                                   \
+}
+
+RADIX_SORT_IMPL(u32, uint32_t, uint32_t)
+RADIX_SORT_IMPL(u64, uint64_t, uint64_t)
+
+typedef struct Radix_Job {
+    const uint64_t *src_keys;
+    const uint64_t *src_values;
+    uint64_t *dst_keys;
+    uint64_t *dst_values;
+    uint64_t begin;
+    uint64_t end;
+    uint32_t shift;
+    // Digit counts of the chunk, turned into its scatter offsets between the two phases
+    uint64_t offsets[RADIX_BUCKETS];
+} Radix_Job;
+
+static void private__count_job(void *data)
+{
+    Radix_Job *job = data;
+    memset(job->offsets, 0, sizeof(job->offsets));
+    for (uint64_t i = job->begin; i < job->end; ++i)
+    {
+        ++job->offsets[(job->src_keys[i] >> job->shift) & (RADIX_BUCKETS - 1)];
+    }
+}
+
+static void private__scatter_job(void *data)
+{
+    Radix_Job *job = data;
+    const uint32_t shift = job->shift;
+    if (job->src_values)
+    {
+        for (uint64_t i = job->begin; i < job->end; ++i)
+        {
+            const uint64_t o = job->offsets[(job->src_keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+            job->dst_keys[o] = job->src_keys[i];
+            job->dst_values[o] = job->src_values[i];
+        }
+    }
+    else
+    {
+        for (uint64_t i = job->begin; i < job->end; ++i)
+        {
+            job->dst_keys[job->offsets[(job->src_keys[i] >> shift) & (RADIX_BUCKETS - 1)]++] = job->src_keys[i];
+        }
+    }
+}
+
+static void private__run_radix_jobs(job_func *task, Radix_Job *jobs, uint32_t num_jobs)
+{
+    Job_Decl decls[RADIX_MAX_JOBS];
+    for (uint32_t j = 0; j < num_jobs; ++j)
+    {
+        decls[j] = (Job_Decl) { .task = task, .data = &jobs[j] };
+    }
+    wait_for_counter_and_free(run_jobs(decls, num_jobs));
+}
+
+// Each pass counts the digit per chunk in parallel, turns the counts into per chunk offsets so that
+// chunk `j` writes its keys of a bucket after those of chunks before it, then scatters in parallel.
+// This keeps the sort stable with no synchronization inside a pass.
+void radix_sort_u64_parallel(uint64_t *keys, uint64_t *values, uint64_t n, Allocator *a)
+{
+    const uint32_t num_workers = job_num_workers();
+    if (num_workers < 2 || n < 2 * RADIX_PARALLEL_CHUNK)
+    {
+        radix_sort_u64(keys, values, n, a);
+        return;
+    }
+
+    const uint32_t num_jobs = (uint32_t)c_min(c_min(n / RADIX_PARALLEL_CHUNK, (uint64_t)num_workers * 4), (uint64_t)RADIX_MAX_JOBS);
+    const uint64_t keys_per_job = (n + num_jobs - 1) / num_jobs;
+
+    uint64_t *scratch_keys = c_alloc(a, n * sizeof(uint64_t));
+    uint64_t *scratch_values = values ? c_alloc(a, n * sizeof(uint64_t)) : 0;
+    Radix_Job *jobs = c_alloc(a, num_jobs * sizeof(Radix_Job));
+
+    uint64_t *src_keys = keys, *dst_keys = scratch_keys;
+    uint64_t *src_values = values, *dst_values = scratch_values;
+    for (uint32_t shift = 0; shift < 64; shift += RADIX_BITS)
+    {
+        for (uint32_t j = 0; j < num_jobs; ++j)
+        {
+            jobs[j].src_keys = src_keys;
+            jobs[j].src_values = src_values;
+            jobs[j].dst_keys = dst_keys;
+            jobs[j].dst_values = dst_values;
+            jobs[j].begin = c_min(j * keys_per_job, n);
+            jobs[j].end = c_min((j + 1) * keys_per_job, n);
+            jobs[j].shift = shift;
+        }
+        private__run_radix_jobs(private__count_job, jobs, num_jobs);
+
+        // Skip the pass if every key has the same digit
+        const uint64_t first_bucket = (src_keys[0] >> shift) & (RADIX_BUCKETS - 1);
+        uint64_t first_bucket_count = 0;
+        for (uint32_t j = 0; j < num_jobs; ++j)
+        {
+            first_bucket_count += jobs[j].offsets[first_bucket];
+        }
+        if (first_bucket_count == n)
+        {
+            continue;
+        }
+
+        uint64_t sum = 0;
+        for (uint32_t b = 0; b < RADIX_BUCKETS; ++b)
+        {
+            for (uint32_t j = 0; j < num_jobs; ++j)
+            {
+                const uint64_t count = jobs[j].offsets[b];
+                jobs[j].offsets[b] = sum;
+                sum += count;
+            }
+        }
+        private__run_radix_jobs(private__scatter_job, jobs, num_jobs);
+
+        uint64_t *k = src_keys; src_keys = dst_keys; dst_keys = k;
+        uint64_t *v = src_values; src_values = dst_values; dst_values = v;
+    }
+
+    if (src_keys != keys)
+    {
+        memcpy(keys, src_keys, n * sizeof(uint64_t));
+        if (values)
+        {
+            memcpy(values, src_values, n * sizeof(uint64_t));
+        }
+    }
+
+    c_free(a, jobs, num_jobs * sizeof(Radix_Job));
+    c_free(a, scratch_keys, n * sizeof(uint64_t));
+    if (values)
+    {
+        c_free(a, scratch_values, n * sizeof(uint64_t));
+    }
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include "basic.h"
+
+struct Allocator;
+
+// Least significant digit radix sorts, 8 bits per pass. Sorting is stable, and passes where every
+// key has the same digit are skipped, so keys that only use their low bits sort in fewer passes.
+// Scratch memory for a copy of the keys and values is allocated from `a` and freed before
+// returning. `values` may be 0 to only sort the keys, otherwise `values[i]` moves with `keys[i]`.
+// They work on any buffer, including arrays from array.h:
+//
+//   radix_sort_u64(keys, indices, array_size(keys), a);
+
+void radix_sort_u32(uint32_t *keys, uint32_t *values, uint64_t n, struct Allocator *a);
+
+void radix_sort_u64(uint64_t *keys, uint64_t *values, uint64_t n, struct Allocator *a);
+
+// `radix_sort_u64()` that splits each pass into jobs on the job system. Falls back to the serial
+// sort when the job system isn't running or `n` is too small for the jobs to pay off. Blocks the
+// calling thread, or yields the calling job, until the keys are sorted.
+void radix_sort_u64_parallel(uint64_t *keys, uint64_t *values, uint64_t n, struct Allocator *a);
@@ -0,0 +1,46 @@
+#include "scratch_allocator.h"
+#include "allocator.h"
+
+enum {
+    SCRATCH_NUM_ARENAS = 2,
+};
+
+// Address space reserved per arena, memory is committed as it's used
+#define SCRATCH_RESERVE_SIZE GB(1)
+
+static THREAD_LOCAL Allocator *scratch_arenas[SCRATCH_NUM_ARENAS];
+
+Scratch scratch_begin(const Allocator *conflict)
+{
+    for (uint32_t i = 0; i < SCRATCH_NUM_ARENAS; ++i)
+    {
+        if (!scratch_arenas[i])
+        {
+            scratch_arenas[i] = linear_allocator_create_vm(SCRATCH_RESERVE_SIZE);
+        }
+
+        Allocator *a = scratch_arenas[i];
+        if (a != conflict)
+        {
+            return (Scratch) { .a = a, .marker = linear_allocator_marker(a) };
+        }
+    }
+    return (Scratch) { 0 };
+}
+
+void scratch_end(Scratch scratch)
+{
+    rewind_linear_allocator_to(scratch.a, scratch.marker);
+}
+
+void scratch_release_thread()
+{
+    for (uint32_t i = 0; i < SCRATCH_NUM_ARENAS; ++i)
+    {
+        if (scratch_arenas[i])
+        {
+            linear_allocator_destroy(scratch_arenas[i]);
+            scratch_arenas[i] = 0;
+        }
+    }
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include "basic.h"
+#include "linear_allocator.h"
+
+struct Allocator;
+
+// A temporary allocation scope in one of the calling thread's scratch arenas
+typedef struct Scratch {
+    struct Allocator *a;
+    Linear_Allocator_Marker marker;
+} Scratch;
+
+// Opens a scope in a thread-local scratch arena. Every thread has two arenas and this picks one
+// that isn't `conflict`, so a function can pass its own scratch allocator to a callee that
+// returns results in it while the callee uses the other arena for its temporaries.
+// `conflict` may be 0. Scopes must be closed in reverse order on the thread that opened them,
+// so don't keep one open across `wait_for_counter_and_free()`.
+Scratch scratch_begin(const struct Allocator *conflict);
+
+// Frees everything allocated in the scope
+void scratch_end(Scratch scratch);
+
+// Releases the calling thread's arenas, call before a thread that used them exits
+void scratch_release_thread();
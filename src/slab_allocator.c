@@ -0,0 +1,486 @@
+#include "slab_allocator.h"
+#include "allocator.h"
+#include "os.h"
+#include "log.h"
+#include "atomics.inl"
+#include <string.h>
+
+enum {
+    SLAB_SIZE = KB(64),
+    SLAB_HEADER_SIZE = 128,
+};
+
+typedef struct Slab {
+    // Objects freed by other threads, pushed lock-free and taken all at once by the owner
+    AtomicU64 remote_free;
+    // Link in the owner's list of slabs with pending remote frees
+    struct Slab *next_remote;
+
+    struct Slab_Thread *owner;
+    // Link in the owner's partial list or the allocator's free slab list
+    struct Slab *prev;
+    struct Slab *next;
+    bool in_partial_list;
+
+    void *local_free;
+    uint32_t size_class;
+    uint32_t object_size;
+    uint32_t capacity;
+    // Objects at index `bump` and up have never been handed out
+    uint32_t bump;
+    uint32_t used;
+} Slab;
+
+STATIC_ASSERT(sizeof(Slab) <= SLAB_HEADER_SIZE);
+
+// Per-thread cache, all fields but `remote_slabs` are only accessed by the owning thread
+typedef struct Slab_Thread {
+    struct Slab_Allocator *allocator;
+    // Slabs owned by this thread that received remote frees
+    AtomicU64 remote_slabs;
+    Slab *current[SLAB_NUM_SIZE_CLASSES];
+    Slab *partial[SLAB_NUM_SIZE_CLASSES];
+    uint64_t live_objects[SLAB_NUM_SIZE_CLASSES];
+    uint32_t num_slabs[SLAB_NUM_SIZE_CLASSES];
+    struct Slab_Thread *next;
+} Slab_Thread;
+
+typedef struct Slab_Allocator {
+    uint32_t id;
+    // Unique per allocator, tells a thread's cache of a destroyed allocator apart from the allocator reusing its id
+    uint64_t serial;
+    void *reserved;
+    uint8_t *base;
+    uint64_t num_slabs;
+    AtomicU64 next_slab;
+    Critical_Section free_slabs_cs;
+    Slab *free_slabs;
+    AtomicU64 threads;
+    Allocator *backing;
+} Slab_Allocator;
+
+static const uint32_t slab_object_sizes[SLAB_NUM_SIZE_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256,
+    320, 384, 448, 512,
+    640, 768, 896, 1024,
+    1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096,
+    5120, 6144, 7168, 8192,
+};
+
+typedef struct Slab_Thread_Slot {
+    uint64_t serial;
+    Slab_Thread *t;
+} Slab_Thread_Slot;
+
+static AtomicU32 slab_allocator_ids = 0;
+static AtomicU64 slab_allocator_serial = 0;
+static THREAD_LOCAL Slab_Thread_Slot slab_threads[MAX_SLAB_ALLOCATORS];
+
+STATIC_ASSERT(MAX_SLAB_ALLOCATORS <= 32);
+
+// Sizes up to 128 are spaced 16 bytes apart, after that there are four classes per power of two
+static inline uint32_t private__size_class(uint64_t size)
+{
+    if (size <= 128)
+    {
+        return size ? (uint32_t)((size + 15) / 16) - 1 : 0;
+    }
+    const uint32_t b = c_highest_bit64(size - 1);
+    return 8 + (b - 7) * 4 + (uint32_t)((size - 1) >> (b - 2)) - 4;
+}
+
+// Class that serves `size` bytes at `align`, or `SLAB_NUM_SIZE_CLASSES` if the backing allocator has
+// to. Objects start `SLAB_HEADER_SIZE` plus a multiple of their size into a `SLAB_SIZE` aligned slab,
+// so they are only aligned to the largest power of two dividing both their size and the header
+// size, e.g. 16 for 48 byte objects. A class serves `align` if both are multiples of it.
+static inline uint32_t private__aligned_size_class(uint64_t size, uint32_t align)
+{
+    size = ALIGN_SIZE(size, align);
+    if (!size || size > SLAB_MAX_OBJECT_SIZE || align > SLAB_HEADER_SIZE)
+    {
+        return SLAB_NUM_SIZE_CLASSES;
+    }
+    const uint32_t size_class = private__size_class(size);
+    return slab_object_sizes[size_class] % align == 0 ? size_class : SLAB_NUM_SIZE_CLASSES;
+}
+
+static inline Slab *private__slab_of(const void *p)
+{
+    return (Slab *)((uint64_t)p & ~(uint64_t)(SLAB_SIZE - 1));
+}
+
+static Slab_Thread *private__thread(Slab_Allocator *sa)
+{
+    Slab_Thread_Slot *slot = &slab_threads[sa->id];
+    if (slot->serial == sa->serial)
+    {
+        return slot->t;
+    }
+
+    Slab_Thread *t = c_alloc(sa->backing, sizeof(*t));
+    memset(t, 0, sizeof(*t));
+    t->allocator = sa;
+    uint64_t head = atomic_load_64(&sa->threads);
+    while (true)
+    {
+        t->next = (Slab_Thread *)head;
+        const uint64_t prev = atomic_compare_exchange_64(&sa->threads, head, (uint64_t)t);
+        if (prev == head)
+        {
+            break;
+        }
+        head = prev;
+    }
+    *slot = (Slab_Thread_Slot) { .serial = sa->serial, .t = t };
+    return t;
+}
+
+static void private__partial_add(Slab_Thread *t, Slab *slab)
+{
+    Slab **head = &t->partial[slab->size_class];
+    slab->prev = 0;
+    slab->next = *head;
+    if (*head)
+    {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+    slab->in_partial_list = true;
+}
+
+static void private__partial_remove(Slab_Thread *t, Slab *slab)
+{
+    if (slab->prev)
+    {
+        slab->prev->next = slab->next;
+    }
+    else
+    {
+        t->partial[slab->size_class] = slab->next;
+    }
+    if (slab->next)
+    {
+        slab->next->prev = slab->prev;
+    }
+    slab->prev = slab->next = 0;
+    slab->in_partial_list = false;
+}
+
+static Slab *private__acquire_slab(Slab_Allocator *sa, Slab_Thread *t, uint32_t size_class)
+{
+    os_enter_critical_section(&sa->free_slabs_cs);
+    Slab *slab = sa->free_slabs;
+    if (slab)
+    {
+        sa->free_slabs = slab->next;
+    }
+    os_leave_critical_section(&sa->free_slabs_cs);
+
+    if (!slab)
+    {
+        const uint64_t index = atomic_fetch_add_64(&sa->next_slab, 1);
+        fatal_checkf(index < sa->num_slabs, "Slab allocator out of memory!");
+        slab = (Slab *)(sa->base + index * SLAB_SIZE);
+        os_commit(slab, SLAB_SIZE);
+    }
+
+    const uint32_t object_size = slab_object_sizes[size_class];
+    *slab = (Slab) {
+        .owner = t,
+        .size_class = size_class,
+        .object_size = object_size,
+        .capacity = (SLAB_SIZE - SLAB_HEADER_SIZE) / object_size,
+    };
+    t->num_slabs[size_class] += 1;
+    return slab;
+}
+
+static void private__release_slab(Slab_Allocator *sa, Slab_Thread *t, Slab *slab)
+{
+    if (slab->in_partial_list)
+    {
+        private__partial_remove(t, slab);
+    }
+    t->num_slabs[slab->size_class] -= 1;
+
+    os_enter_critical_section(&sa->free_slabs_cs);
+    slab->next = sa->free_slabs;
+    sa->free_slabs = slab;
+    os_leave_critical_section(&sa->free_slabs_cs);
+}
+
+// Called by the owner whenever an object was returned to `slab`
+static void private__on_slab_freed(Slab_Allocator *sa, Slab_Thread *t, Slab *slab)
+{
+    if (slab == t->current[slab->size_class])
+    {
+        return;
+    }
+    if (slab->used == 0)
+    {
+        private__release_slab(sa, t, slab);
+    }
+    else if (!slab->in_partial_list)
+    {
+        private__partial_add(t, slab);
+    }
+}
+
+static void private__collect_remote_frees(Slab_Allocator *sa, Slab_Thread *t)
+{
+    Slab *slab = (Slab *)atomic_exchange_64(&t->remote_slabs, 0);
+    while (slab)
+    {
+        // Read the link before the remote list is emptied, after that the slab may be pushed again
+        Slab *next = slab->next_remote;
+        void *p = (void *)atomic_exchange_64(&slab->remote_free, 0);
+        uint32_t n = 0;
+        while (p)
+        {
+            void *next_p = *(void **)p;
+            *(void **)p = slab->local_free;
+            slab->local_free = p;
+            p = next_p;
+            ++n;
+        }
+        slab->used -= n;
+        t->live_objects[slab->size_class] -= n;
+        private__on_slab_freed(sa, t, slab);
+        slab = next;
+    }
+}
+
+static void *private__alloc_small(Slab_Allocator *sa, uint32_t size_class)
+{
+    Slab_Thread *t = private__thread(sa);
+    while (true)
+    {
+        Slab *slab = t->current[size_class];
+        if (slab)
+        {
+            void *p = slab->local_free;
+            if (p)
+            {
+                slab->local_free = *(void **)p;
+            }
+            else if (slab->bump < slab->capacity)
+            {
+                p = (uint8_t *)slab + SLAB_HEADER_SIZE + (uint64_t)slab->bump * slab->object_size;
+                ++slab->bump;
+            }
+            if (p)
+            {
+                ++slab->used;
+                ++t->live_objects[size_class];
+                return p;
+            }
+        }
+
+        // Current slab is exhausted, it is dropped from all lists until an object is freed to it
+        t->current[size_class] = 0;
+        private__collect_remote_frees(sa, t);
+
+        slab = t->partial[size_class];
+        if (slab)
+        {
+            private__partial_remove(t, slab);
+        }
+        else
+        {
+            slab = private__acquire_slab(sa, t, size_class);
+        }
+        t->current[size_class] = slab;
+    }
+}
+
+static void private__free_small(Slab_Allocator *sa, void *p)
+{
+    Slab *slab = private__slab_of(p);
+    const Slab_Thread_Slot *slot = &slab_threads[sa->id];
+    Slab_Thread *t = slot->serial == sa->serial ? slot->t : 0;
+
+    if (slab->owner == t)
+    {
+        *(void **)p = slab->local_free;
+        slab->local_free = p;
+        --slab->used;
+        --t->live_objects[slab->size_class];
+        private__on_slab_freed(sa, t, slab);
+        return;
+    }
+
+    // Cross-thread free, the first object in an empty remote list also queues the slab with its owner
+    uint64_t head = atomic_load_64(&slab->remote_free);
+    while (true)
+    {
+        *(void **)p = (void *)head;
+        const uint64_t prev = atomic_compare_exchange_64(&slab->remote_free, head, (uint64_t)p);
+        if (prev == head)
+        {
+            break;
+        }
+        head = prev;
+    }
+
+    if (head == 0)
+    {
+        Slab_Thread *owner = slab->owner;
+        uint64_t slabs = atomic_load_64(&owner->remote_slabs);
+        while (true)
+        {
+            slab->next_remote = (Slab *)slabs;
+            const uint64_t prev = atomic_compare_exchange_64(&owner->remote_slabs, slabs, (uint64_t)slab);
+            if (prev == slabs)
+            {
+                break;
+            }
+            slabs = prev;
+        }
+    }
+}
+
+static void *slab_alloc(Allocator *allocator, void *old_ptr, uint64_t old_size, uint64_t new_size,
+        uint32_t align, const char *file, uint32_t line)
+{
+    Slab_Allocator *sa = allocator->user_data;
+    align = align ? align : ALLOCATOR_DEFAULT_ALIGN;
+    const uint32_t old_class = old_ptr ? private__aligned_size_class(old_size, align) : SLAB_NUM_SIZE_CLASSES;
+    const uint32_t new_class = private__aligned_size_class(new_size, align);
+    const bool old_small = old_class < SLAB_NUM_SIZE_CLASSES;
+    const bool new_small = new_class < SLAB_NUM_SIZE_CLASSES;
+
+    if (old_ptr && !old_small && new_size && !new_small)
+    {
+        return sa->backing->allocate_func(sa->backing, old_ptr, old_size, new_size, align, file, line);
+    }
+
+    if (old_small && new_small && old_class == new_class)
+    {
+        record_deallocation(allocator, old_ptr, old_size);
+        record_allocation(allocator, old_ptr, new_size, file, line);
+        return old_ptr;
+    }
+
+    void *new_ptr = 0;
+    if (new_small)
+    {
+        new_ptr = private__alloc_small(sa, new_class);
+        record_allocation(allocator, new_ptr, new_size, file, line);
+    }
+    else if (new_size)
+    {
+        new_ptr = sa->backing->allocate_func(sa->backing, 0, 0, new_size, align, file, line);
+    }
+
+    if (old_ptr && new_ptr)
+    {
+        memcpy(new_ptr, old_ptr, c_min(old_size, new_size));
+    }
+
+    if (old_small)
+    {
+        record_deallocation(allocator, old_ptr, old_size);
+        private__free_small(sa, old_ptr);
+    }
+    else if (old_ptr)
+    {
+        sa->backing->allocate_func(sa->backing, old_ptr, old_size, 0, align, file, line);
+    }
+
+    return new_ptr;
+}
+
+Allocator *slab_allocator_create(uint64_t reserve_size, Allocator *backing)
+{
+    uint32_t id = MAX_SLAB_ALLOCATORS;
+    uint32_t ids = atomic_load_32(&slab_allocator_ids);
+    while (ids != ~0U)
+    {
+        const uint32_t free_id = c_lowest_bit32(~ids);
+        const uint32_t prev = atomic_compare_exchange_32(&slab_allocator_ids, ids, ids | (1U << free_id));
+        if (prev == ids)
+        {
+            id = free_id;
+            break;
+        }
+        ids = prev;
+    }
+    fatal_checkf(id < MAX_SLAB_ALLOCATORS, "Too many slab allocators created!");
+
+    Allocator *a = c_alloc(backing, sizeof(*a));
+    *a = (Allocator) {
+        .allocate_func = slab_alloc,
+        .user_data = c_alloc(backing, sizeof(Slab_Allocator)),
+    };
+
+    // Over-reserve so that slabs can be aligned to their size, objects find their slab by masking
+    Slab_Allocator *sa = a->user_data;
+    memset(sa, 0, sizeof(*sa));
+    sa->id = id;
+    sa->serial = atomic_fetch_add_64(&slab_allocator_serial, 1) + 1;
+    sa->num_slabs = c_max(reserve_size / SLAB_SIZE, 1);
+    sa->reserved = os_reserve((sa->num_slabs + 1) * SLAB_SIZE);
+    sa->base = (uint8_t *)ALIGN_SIZE((uint64_t)sa->reserved, SLAB_SIZE);
+    sa->backing = backing;
+    os_create_critical_section(&sa->free_slabs_cs);
+
+    return a;
+}
+
+void slab_allocator_destroy(Allocator *a)
+{
+    Slab_Allocator *sa = a->user_data;
+    Allocator *backing = sa->backing;
+
+    Slab_Thread *t = (Slab_Thread *)atomic_load_64(&sa->threads);
+    while (t)
+    {
+        Slab_Thread *next = t->next;
+        c_free(backing, t, sizeof(*t));
+        t = next;
+    }
+
+    os_release(sa->reserved);
+
+    // Caches of other threads still point to the freed state, the new serial of an allocator
+    // reusing the id tells them apart
+    uint32_t ids = atomic_load_32(&slab_allocator_ids);
+    while (true)
+    {
+        const uint32_t prev = atomic_compare_exchange_32(&slab_allocator_ids, ids, ids & ~(1U << sa->id));
+        if (prev == ids)
+        {
+            break;
+        }
+        ids = prev;
+    }
+
+    c_free(backing, sa, sizeof(*sa));
+    c_free(backing, a, sizeof(*a));
+}
+
+void slab_allocator_stats(Allocator *a, Slab_Size_Class_Stats stats[SLAB_NUM_SIZE_CLASSES])
+{
+    Slab_Allocator *sa = a->user_data;
+    for (uint32_t i = 0; i < SLAB_NUM_SIZE_CLASSES; ++i)
+    {
+        stats[i] = (Slab_Size_Class_Stats) { .object_size = slab_object_sizes[i] };
+    }
+
+    // Counters are owned by their threads, so this is a snapshot that may be slightly off
+    for (Slab_Thread *t = (Slab_Thread *)atomic_load_64(&sa->threads); t; t = t->next)
+    {
+        for (uint32_t i = 0; i < SLAB_NUM_SIZE_CLASSES; ++i)
+        {
+            stats[i].num_slabs += t->num_slabs[i];
+            stats[i].live_objects += t->live_objects[i];
+        }
+    }
+
+    for (uint32_t i = 0; i < SLAB_NUM_SIZE_CLASSES; ++i)
+    {
+        stats[i].capacity = (uint64_t)stats[i].num_slabs * ((SLAB_SIZE - SLAB_HEADER_SIZE) / slab_object_sizes[i]);
+    }
+}
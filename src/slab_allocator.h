@@ -0,0 +1,34 @@
+#pragma once
+#include "basic.h"
+
+struct Allocator;
+
+enum {
+    SLAB_NUM_SIZE_CLASSES = 32,
+    // Larger allocations are forwarded to the backing allocator
+    SLAB_MAX_OBJECT_SIZE = 8192,
+    // Slab allocators alive at the same time, ids of destroyed ones are reused
+    MAX_SLAB_ALLOCATORS = 32,
+};
+
+typedef struct Slab_Size_Class_Stats {
+    uint32_t object_size;
+    uint32_t num_slabs;
+    // Objects freed on another thread count as live until the owning thread collects them
+    uint64_t live_objects;
+    uint64_t capacity;
+} Slab_Size_Class_Stats;
+
+// Creates a size-class slab allocator that carves 64 KB slabs out of `reserve_size` bytes of
+// reserved virtual memory. Every thread allocates from its own slabs without locking, objects
+// freed on another thread are handed back to the owning thread lock-free.
+// `backing` serves allocations larger than `SLAB_MAX_OBJECT_SIZE`, alignments that no size class
+// satisfies and the allocator's own bookkeeping.
+// Slabs are only reclaimed by the thread that owns them, so use it from long-lived threads.
+// At most `MAX_SLAB_ALLOCATORS` slab allocators can exist at once.
+struct Allocator *slab_allocator_create(uint64_t reserve_size, struct Allocator *backing);
+
+void slab_allocator_destroy(struct Allocator *a);
+
+// Reports occupancy per size class
+void slab_allocator_stats(struct Allocator *a, Slab_Size_Class_Stats stats[SLAB_NUM_SIZE_CLASSES]);
@@ -0,0 +1,165 @@
+#pragma once
+#include "basic.h"
+#include "allocator.h"
+#include "array.h"
+#include "log.h"
+
+#include <string.h>
+
+#define INVALID_SLOT_ID 0xffffffffffffffffULL
+
+// Handle to a value in a `Slot_Map`. `index` never changes while the value is alive, so it can
+// also index arrays kept next to the map. `generation` is bumped when the value is removed, which
+// makes old handles to a reused slot fail their lookups.
+typedef union Slot_Id {
+    struct {
+        uint32_t index;
+        uint32_t generation;
+    };
+    uint64_t id;
+} Slot_Id;
+
+typedef struct Slot_Map_Slot {
+    // Position of the value in the dense arrays when alive, otherwise the next free slot
+    uint32_t dense_index;
+    uint32_t generation;
+} Slot_Map_Slot;
+
+// Generational handle store with O(1) insert, remove and lookup. Values are kept densely packed,
+// removals move the last value into the hole, so iterating only visits live values:
+//
+//   for (uint32_t i = 0; i < slot_map_size(&map); ++i)
+//       ... slot_map_value_at(&map, i), slot_map_id_at(&map, i)
+//
+// Iterate backwards to remove values while iterating. Values move on removal, so pointers to them
+// are valid until the next insert or remove, hold on to the `Slot_Id` instead. A `value_size` of 0
+// makes a map of handles only.
+//
+//   Slot_Map map = slot_map_init(sizeof(Entity));
+typedef struct Slot_Map {
+    uint32_t value_size;
+    // Head of the free slot list, `UINT32_MAX` if empty
+    uint32_t free_head;
+    // Arrays, see array.h
+    Slot_Map_Slot *slots;
+    uint32_t *dense_to_slot;
+    // `value_size` sized values in the same order as `dense_to_slot`
+    uint8_t *values;
+    uint64_t values_capacity;
+} Slot_Map;
+
+#define slot_map_init(size) \
+    ((Slot_Map) { .value_size = (size), .free_head = UINT32_MAX })
+
+// Value of `id` cast to `T *`, 0 if `id` is stale
+#define slot_map_get_typed(map, T, id) \
+    ((T *)slot_map_get(map, id))
+
+// Number of live values
+static inline uint32_t slot_map_size(const Slot_Map *map)
+{
+    return (uint32_t)array_size(map->dense_to_slot);
+}
+
+static inline bool slot_map_has(const Slot_Map *map, Slot_Id id)
+{
+    // Free slots are a generation ahead of every handle given out for them
+    return id.index < array_size(map->slots) && map->slots[id.index].generation == id.generation;
+}
+
+// Value at position `i` of the dense storage, `i` must be below `slot_map_size()`
+static inline void *slot_map_value_at(const Slot_Map *map, uint32_t i)
+{
+    check(i < slot_map_size(map));
+    return map->values + (uint64_t)i * map->value_size;
+}
+
+// Handle of the value at position `i` of the dense storage
+static inline Slot_Id slot_map_id_at(const Slot_Map *map, uint32_t i)
+{
+    check(i < slot_map_size(map));
+    const uint32_t index = map->dense_to_slot[i];
+    return (Slot_Id) { .index = index, .generation = map->slots[index].generation };
+}
+
+// Value of `id`, 0 if `id` is stale
+static inline void *slot_map_get(const Slot_Map *map, Slot_Id id)
+{
+    return slot_map_has(map, id) ? slot_map_value_at(map, map->slots[id.index].dense_index) : 0;
+}
+
+// Add a zeroed value and return its handle, slots of removed values are reused first
+static inline Slot_Id slot_map_insert(Slot_Map *map, struct Allocator *a)
+{
+    uint32_t index = map->free_head;
+    if (index != UINT32_MAX)
+    {
+        map->free_head = map->slots[index].dense_index;
+    }
+    else
+    {
+        fatal_checkf(array_size(map->slots) < UINT32_MAX, "Slot map is full!");
+        index = (uint32_t)array_size(map->slots);
+        array_push(map->slots, ((Slot_Map_Slot) { 0 }), a);
+    }
+
+    const uint32_t dense_index = slot_map_size(map);
+    if (map->value_size)
+    {
+        if (dense_index == map->values_capacity)
+        {
+            const uint64_t new_capacity = map->values_capacity ? map->values_capacity * 2 : 16;
+            map->values = c_realloc(a, map->values, map->values_capacity * map->value_size, new_capacity * map->value_size);
+            map->values_capacity = new_capacity;
+        }
+        memset(map->values + (uint64_t)dense_index * map->value_size, 0, map->value_size);
+    }
+    array_push(map->dense_to_slot, index, a);
+    map->slots[index].dense_index = dense_index;
+    return (Slot_Id) { .index = index, .generation = map->slots[index].generation };
+}
+
+// Remove the value of `id`, the last value is moved into its place. Returns false if `id` is stale.
+static inline bool slot_map_remove(Slot_Map *map, Slot_Id id)
+{
+    if (!slot_map_has(map, id))
+        return false;
+
+    Slot_Map_Slot *slot = &map->slots[id.index];
+    const uint32_t last = slot_map_size(map) - 1;
+    if (slot->dense_index != last)
+    {
+        const uint32_t moved = map->dense_to_slot[last];
+        if (map->value_size)
+        {
+            memcpy(map->values + (uint64_t)slot->dense_index * map->value_size,
+                map->values + (uint64_t)last * map->value_size, map->value_size);
+        }
+        map->dense_to_slot[slot->dense_index] = moved;
+        map->slots[moved].dense_index = slot->dense_index;
+    }
+    array_header(map->dense_to_slot)->size -= 1;
+
+    slot->generation += 1;
+    slot->dense_index = map->free_head;
+    map->free_head = id.index;
+    return true;
+}
+
+// Remove all values, every outstanding handle becomes stale
+static inline void slot_map_clear(Slot_Map *map)
+{
+    for (uint32_t i = slot_map_size(map); i-- > 0;)
+    {
+        slot_map_remove(map, slot_map_id_at(map, i));
+    }
+}
+
+static inline void slot_map_free(Slot_Map *map, struct Allocator *a)
+{
+    array_free(map->slots, a);
+    array_free(map->dense_to_slot, a);
+    if (map->values)
+        c_free(a, map->values, map->values_capacity * map->value_size);
+    *map = slot_map_init(map->value_size);
+}
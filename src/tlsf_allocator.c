@@ -0,0 +1,426 @@
+#include "tlsf_allocator.h"
+#include "allocator.h"
+#include "os.h"
+#include "log.h"
+#include <string.h>
+
+enum {
+    TLSF_ALIGNMENT = 16,
+    TLSF_SL_LOG2 = 4,
+    TLSF_SL_COUNT = 1 << TLSF_SL_LOG2,
+    // Sizes below `TLSF_SMALL_BLOCK_SIZE` are linearly spaced in the first level
+    TLSF_FL_SHIFT = TLSF_SL_LOG2 + 4,
+    TLSF_FL_MAX = 40,
+    TLSF_FL_COUNT = TLSF_FL_MAX - TLSF_FL_SHIFT + 1,
+    TLSF_SMALL_BLOCK_SIZE = 1 << TLSF_FL_SHIFT,
+    TLSF_MIN_GROW_SIZE = KB(64),
+};
+
+#define TLSF_BLOCK_FREE 1ULL
+#define TLSF_PREV_FREE 2ULL
+#define TLSF_SIZE_MASK (~(uint64_t)(TLSF_ALIGNMENT - 1))
+
+// Blocks are laid out back to back, the payload follows `prev_phys` and `size`.
+// The free list links are only valid while the block is free and overlap the payload.
+typedef struct Tlsf_Block {
+    struct Tlsf_Block *prev_phys;
+    uint64_t size;
+    struct Tlsf_Block *next_free;
+    struct Tlsf_Block *prev_free;
+} Tlsf_Block;
+
+enum {
+    TLSF_HEADER_SIZE = 2 * sizeof(uint64_t),
+    TLSF_MIN_BLOCK_SIZE = sizeof(Tlsf_Block) - TLSF_HEADER_SIZE,
+};
+
+typedef struct Tlsf_Allocator {
+    Allocator allocator;
+    Critical_Section cs;
+    uint8_t *base;
+    uint64_t reserve_size;
+    uint64_t committed;
+    // Zero-sized used block at the end of the committed memory
+    Tlsf_Block *sentinel;
+    uint64_t used;
+    uint64_t free;
+    uint64_t num_free_blocks;
+    uint64_t fl_bitmap;
+    uint32_t sl_bitmap[TLSF_FL_COUNT];
+    Tlsf_Block *blocks[TLSF_FL_COUNT][TLSF_SL_COUNT];
+} Tlsf_Allocator;
+
+static inline uint64_t private__block_size(const Tlsf_Block *b)
+{
+    return b->size & TLSF_SIZE_MASK;
+}
+
+static inline void private__set_block_size(Tlsf_Block *b, uint64_t size)
+{
+    b->size = size | (b->size & ~TLSF_SIZE_MASK);
+}
+
+static inline void *private__payload(Tlsf_Block *b)
+{
+    return (uint8_t *)b + TLSF_HEADER_SIZE;
+}
+
+static inline Tlsf_Block *private__block_of(void *p)
+{
+    return (Tlsf_Block *)((uint8_t *)p - TLSF_HEADER_SIZE);
+}
+
+static inline Tlsf_Block *private__next_phys(Tlsf_Block *b)
+{
+    return (Tlsf_Block *)((uint8_t *)b + TLSF_HEADER_SIZE + private__block_size(b));
+}
+
+static inline void private__mapping_insert(uint64_t size, uint32_t *fl, uint32_t *sl)
+{
+    if (size < TLSF_SMALL_BLOCK_SIZE)
+    {
+        *fl = 0;
+        *sl = (uint32_t)(size / (TLSF_SMALL_BLOCK_SIZE / TLSF_SL_COUNT));
+    }
+    else
+    {
+        const uint32_t f = c_highest_bit64(size);
+        *sl = (uint32_t)(size >> (f - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+        *fl = f - TLSF_FL_SHIFT + 1;
+    }
+}
+
+// Rounds `size` up to the next list so that any block found there is large enough
+static inline uint64_t private__search_size(uint64_t size)
+{
+    if (size >= TLSF_SMALL_BLOCK_SIZE)
+    {
+        size += (1ULL << (c_highest_bit64(size) - TLSF_SL_LOG2)) - 1;
+    }
+    return size;
+}
+
+static void private__insert_free_block(Tlsf_Allocator *t, Tlsf_Block *b)
+{
+    uint32_t fl, sl;
+    private__mapping_insert(private__block_size(b), &fl, &sl);
+    Tlsf_Block *head = t->blocks[fl][sl];
+    b->next_free = head;
+    b->prev_free = 0;
+    if (head)
+    {
+        head->prev_free = b;
+    }
+    t->blocks[fl][sl] = b;
+    t->fl_bitmap |= 1ULL << fl;
+    t->sl_bitmap[fl] |= 1U << sl;
+    t->free += private__block_size(b);
+    t->num_free_blocks += 1;
+}
+
+static void private__remove_free_block(Tlsf_Allocator *t, Tlsf_Block *b)
+{
+    uint32_t fl, sl;
+    private__mapping_insert(private__block_size(b), &fl, &sl);
+    if (b->prev_free)
+    {
+        b->prev_free->next_free = b->next_free;
+    }
+    else
+    {
+        t->blocks[fl][sl] = b->next_free;
+        if (!b->next_free)
+        {
+            t->sl_bitmap[fl] &= ~(1U << sl);
+            if (!t->sl_bitmap[fl])
+            {
+                t->fl_bitmap &= ~(1ULL << fl);
+            }
+        }
+    }
+    if (b->next_free)
+    {
+        b->next_free->prev_free = b->prev_free;
+    }
+    t->free -= private__block_size(b);
+    t->num_free_blocks -= 1;
+}
+
+static Tlsf_Block *private__find_free_block(Tlsf_Allocator *t, uint64_t size)
+{
+    uint32_t fl, sl;
+    private__mapping_insert(private__search_size(size), &fl, &sl);
+    if (fl >= TLSF_FL_COUNT)
+    {
+        return 0;
+    }
+
+    uint32_t sl_map = t->sl_bitmap[fl] & (~0U << sl);
+    if (!sl_map)
+    {
+        const uint64_t fl_map = t->fl_bitmap & (~0ULL << (fl + 1));
+        if (!fl_map)
+        {
+            return 0;
+        }
+        fl = c_lowest_bit64(fl_map);
+        sl_map = t->sl_bitmap[fl];
+    }
+    sl = c_lowest_bit64(sl_map);
+    return t->blocks[fl][sl];
+}
+
+static void private__mark_used(Tlsf_Block *b)
+{
+    b->size &= ~TLSF_BLOCK_FREE;
+    private__next_phys(b)->size &= ~TLSF_PREV_FREE;
+}
+
+// Merges `b` with its free neighbours and puts it in the free lists
+static void private__free_block(Tlsf_Allocator *t, Tlsf_Block *b)
+{
+    if (b->size & TLSF_PREV_FREE)
+    {
+        Tlsf_Block *prev = b->prev_phys;
+        private__remove_free_block(t, prev);
+        private__set_block_size(prev, private__block_size(prev) + TLSF_HEADER_SIZE + private__block_size(b));
+        b = prev;
+    }
+
+    Tlsf_Block *next = private__next_phys(b);
+    if (next->size & TLSF_BLOCK_FREE)
+    {
+        private__remove_free_block(t, next);
+        private__set_block_size(b, private__block_size(b) + TLSF_HEADER_SIZE + private__block_size(next));
+        next = private__next_phys(b);
+    }
+
+    b->size |= TLSF_BLOCK_FREE;
+    next->prev_phys = b;
+    next->size |= TLSF_PREV_FREE;
+    private__insert_free_block(t, b);
+}
+
+// Shrinks used block `b` to `size` and frees the remainder if it can hold a block
+static void private__trim_used(Tlsf_Allocator *t, Tlsf_Block *b, uint64_t size)
+{
+    const uint64_t block_size = private__block_size(b);
+    if (block_size < size + TLSF_HEADER_SIZE + TLSF_MIN_BLOCK_SIZE)
+    {
+        return;
+    }
+
+    private__set_block_size(b, size);
+    t->used -= block_size - size;
+    Tlsf_Block *rest = private__next_phys(b);
+    rest->prev_phys = b;
+    rest->size = block_size - size - TLSF_HEADER_SIZE;
+    private__next_phys(rest)->prev_phys = rest;
+    private__free_block(t, rest);
+}
+
+// Commits more memory at the end of the heap, the new space becomes a free block
+static bool private__grow(Tlsf_Allocator *t, uint64_t size)
+{
+    Tlsf_Block *s = t->sentinel;
+    uint64_t new_committed = ALIGN_SIZE((uint64_t)((uint8_t *)s - t->base) + 2 * TLSF_HEADER_SIZE + size, PAGE_SIZE);
+    new_committed = c_max(new_committed, t->committed + TLSF_MIN_GROW_SIZE);
+    new_committed = c_min(new_committed, t->reserve_size);
+    if ((uint64_t)((uint8_t *)s - t->base) + 2 * TLSF_HEADER_SIZE + size > new_committed)
+    {
+        return false;
+    }
+
+    os_commit(t->base + t->committed, new_committed - t->committed);
+    t->committed = new_committed;
+
+    // The old sentinel becomes the header of the new block
+    const uint64_t block_size = (uint64_t)(t->base + new_committed - (uint8_t *)s) - 2 * TLSF_HEADER_SIZE;
+    private__set_block_size(s, block_size);
+
+    t->sentinel = private__next_phys(s);
+    t->sentinel->prev_phys = s;
+    t->sentinel->size = 0;
+
+    private__free_block(t, s);
+    return true;
+}
+
+static void *private__allocate(Tlsf_Allocator *t, uint64_t size, uint64_t align)
+{
+    size = c_max(ALIGN_SIZE(size, TLSF_ALIGNMENT), TLSF_MIN_BLOCK_SIZE);
+
+    // Over-aligned allocations need room to split off a free block in front of the payload
+    const uint64_t gap_size = TLSF_HEADER_SIZE + TLSF_MIN_BLOCK_SIZE;
+    const uint64_t search_size = align > TLSF_ALIGNMENT ? size + align + gap_size : size;
+
+    Tlsf_Block *b = private__find_free_block(t, search_size);
+    if (!b)
+    {
+        if (!private__grow(t, private__search_size(search_size)))
+        {
+            return 0;
+        }
+        b = private__find_free_block(t, search_size);
+    }
+
+    private__remove_free_block(t, b);
+    private__mark_used(b);
+
+    const uint64_t payload = (uint64_t)(uintptr_t)private__payload(b);
+    uint64_t aligned = align > TLSF_ALIGNMENT ? ALIGN_SIZE(payload, align) : payload;
+    while (aligned != payload && aligned - payload < gap_size)
+    {
+        aligned += align;
+    }
+    if (aligned != payload)
+    {
+        const uint64_t gap = aligned - payload;
+        Tlsf_Block *aligned_block = private__block_of((void *)(uintptr_t)aligned);
+        aligned_block->size = private__block_size(b) - gap;
+        aligned_block->prev_phys = b;
+        private__next_phys(aligned_block)->prev_phys = aligned_block;
+        private__set_block_size(b, gap - TLSF_HEADER_SIZE);
+        private__free_block(t, b);
+        b = aligned_block;
+    }
+
+    t->used += private__block_size(b);
+    private__trim_used(t, b, size);
+    return private__payload(b);
+}
+
+static void private__free(Tlsf_Allocator *t, void *p)
+{
+    Tlsf_Block *b = private__block_of(p);
+    t->used -= private__block_size(b);
+    private__free_block(t, b);
+}
+
+static void *private__reallocate(Tlsf_Allocator *t, void *p, uint64_t old_size, uint64_t new_size, uint64_t align)
+{
+    Tlsf_Block *b = private__block_of(p);
+    const uint64_t size = c_max(ALIGN_SIZE(new_size, TLSF_ALIGNMENT), TLSF_MIN_BLOCK_SIZE);
+    const uint64_t block_size = private__block_size(b);
+
+    // Absorb the next block in place if it is free and large enough
+    Tlsf_Block *next = private__next_phys(b);
+    if (size > block_size && (next->size & TLSF_BLOCK_FREE) && block_size + TLSF_HEADER_SIZE + private__block_size(next) >= size)
+    {
+        private__remove_free_block(t, next);
+        private__set_block_size(b, block_size + TLSF_HEADER_SIZE + private__block_size(next));
+        private__next_phys(b)->prev_phys = b;
+        private__mark_used(b);
+        t->used += private__block_size(b) - block_size;
+    }
+
+    if (size <= private__block_size(b))
+    {
+        private__trim_used(t, b, size);
+        return p;
+    }
+
+    void *new_p = private__allocate(t, new_size, align);
+    if (new_p)
+    {
+        memcpy(new_p, p, c_min(old_size, new_size));
+        private__free(t, p);
+    }
+    return new_p;
+}
+
+static void *tlsf_alloc(Allocator *allocator, void *old_ptr, uint64_t old_size, uint64_t new_size,
+        uint32_t align, const char *file, uint32_t line)
+{
+    Tlsf_Allocator *t = allocator->user_data;
+
+    if (old_ptr)
+    {
+        record_deallocation(allocator, old_ptr, old_size);
+    }
+
+    void *new_ptr = 0;
+    os_enter_critical_section(&t->cs);
+    if (old_ptr && new_size)
+    {
+        new_ptr = private__reallocate(t, old_ptr, old_size, new_size, align);
+    }
+    else if (new_size)
+    {
+        new_ptr = private__allocate(t, new_size, align);
+    }
+    else if (old_ptr)
+    {
+        private__free(t, old_ptr);
+    }
+    os_leave_critical_section(&t->cs);
+
+    fatal_checkf(new_ptr || !new_size, "TLSF allocator out of memory!");
+
+    if (new_ptr)
+    {
+        record_allocation(allocator, new_ptr, new_size, file, line);
+    }
+
+    return new_ptr;
+}
+
+Allocator *tlsf_allocator_create(uint64_t reserve_size)
+{
+    reserve_size = ALIGN_SIZE(reserve_size, PAGE_SIZE);
+    uint8_t *base = os_reserve(reserve_size);
+    const uint64_t header_size = ALIGN_SIZE(sizeof(Tlsf_Allocator), TLSF_ALIGNMENT);
+    const uint64_t committed = ALIGN_SIZE(header_size + TLSF_HEADER_SIZE, PAGE_SIZE);
+    os_commit(base, committed);
+
+    Tlsf_Allocator *t = (Tlsf_Allocator *)base;
+    memset(t, 0, sizeof(*t));
+    t->allocator = (Allocator) {
+        .allocate_func = tlsf_alloc,
+        .user_data = t,
+    };
+    os_create_critical_section(&t->cs);
+    t->base = base;
+    t->reserve_size = reserve_size;
+    t->committed = committed;
+    t->sentinel = (Tlsf_Block *)(base + header_size);
+    t->sentinel->prev_phys = 0;
+    t->sentinel->size = 0;
+
+    return &t->allocator;
+}
+
+void tlsf_allocator_destroy(Allocator *a)
+{
+    Tlsf_Allocator *t = a->user_data;
+    os_release(t->base);
+}
+
+Tlsf_Stats tlsf_allocator_stats(Allocator *a)
+{
+    Tlsf_Allocator *t = a->user_data;
+
+    os_enter_critical_section(&t->cs);
+    Tlsf_Stats stats = {
+        .reserved = t->reserve_size,
+        .committed = t->committed,
+        .used = t->used,
+        .free = t->free,
+        .num_free_blocks = t->num_free_blocks,
+    };
+
+    // The largest free block is in the highest non-empty list
+    if (t->fl_bitmap)
+    {
+        const uint32_t fl = c_highest_bit64(t->fl_bitmap);
+        const uint32_t sl = c_highest_bit64(t->sl_bitmap[fl]);
+        for (Tlsf_Block *b = t->blocks[fl][sl]; b; b = b->next_free)
+        {
+            stats.largest_free_block = c_max(stats.largest_free_block, private__block_size(b));
+        }
+    }
+    os_leave_critical_section(&t->cs);
+
+    stats.fragmentation = stats.free ? 1.f - (float)((double)stats.largest_free_block / (double)stats.free) : 0.f;
+    return stats;
+}
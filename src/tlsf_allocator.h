@@ -0,0 +1,25 @@
+#pragma once
+#include "basic.h"
+
+struct Allocator;
+
+typedef struct Tlsf_Stats {
+    uint64_t reserved;
+    uint64_t committed;
+    // Payload bytes in used and free blocks
+    uint64_t used;
+    uint64_t free;
+    uint64_t largest_free_block;
+    uint64_t num_free_blocks;
+    // 1 - largest_free_block / free, 0 when all free memory is in one block
+    float fragmentation;
+} Tlsf_Stats;
+
+// Creates a Two-Level Segregated Fit allocator with O(1) allocation and freeing. Memory is
+// committed on demand inside a `reserve_size` virtual memory reservation, which also holds
+// the allocator itself. Thread-safe.
+struct Allocator *tlsf_allocator_create(uint64_t reserve_size);
+
+void tlsf_allocator_destroy(struct Allocator *a);
+
+Tlsf_Stats tlsf_allocator_stats(struct Allocator *a);